@@ -51,7 +51,7 @@ public:
 
 		rec.normal = vec3(1, 0, 0); // arbitrary
 		rec.front_face = true; // also arbitrary
-		rec.mat = phase_function;
+		rec.mat = phase_function.get();
 
 		return true;
 	}
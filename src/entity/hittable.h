@@ -12,6 +12,7 @@
 #include <memory>
 
 #include "math/aabb.h"
+#include "math/mat4.h"
 #include "math/vec3.h"
 #include "render/ray.h"
 
@@ -22,8 +23,11 @@ class hit_record
 public:
 	point3 p;
 	vec3 normal;
-	::shared_ptr<material> mat;
+	// Non-owning: primitives hold the shared_ptr for the scene's lifetime, so hits only pass the
+	// address around and never touch the reference count.
+	const material* mat = nullptr;
 	double t;
+	bool sampled_light = false; // The primitive hit is one the camera's light_list samples
 
 	// ��������
 	double u;
@@ -46,9 +50,36 @@ class hittable
 public:
 	virtual ~hittable() = default;
 
+	// Closest hit within ray_t. rec is only written when this returns true.
 	virtual bool hit(const ray& r, interval ray_t, hit_record& rec) const = 0;
 
+	/// <summary>
+	/// Any-hit query: whether anything blocks the ray within ray_t. It can stop at the first
+	/// intersection found and fills no hit_record, so shadow and visibility rays should use it.
+	/// </summary>
+	virtual bool occluded(const ray& r, const interval ray_t) const
+	{
+		hit_record rec;
+		return hit(r, ray_t, rec);
+	}
+
 	virtual aabb bounding_box() const = 0;
+
+	// Area light sampling. Primitives that can be light sources (quad, triangle, sphere) return
+	// their material from light_material() and override the two functions below.
+
+	virtual const material* light_material() const { return nullptr; }
+
+	// Called by light_list for the primitives it samples; their hits then set
+	// hit_record::sampled_light.
+	virtual void mark_sampled_light() {}
+
+	// Solid angle density, seen from origin, of the directions random() returns. Both take the
+	// ray time, for primitives that move.
+	virtual double pdf_value(const point3& /*origin*/, const vec3& /*direction*/, double /*time*/) const { return 0; }
+
+	// A direction from origin towards a point sampled uniformly over the primitive's area.
+	virtual vec3 random(const point3& /*origin*/, double /*time*/) const { return {1, 0, 0}; }
 };
 
 
@@ -66,7 +97,7 @@ public:
 	bool hit(const ray& r, const interval ray_t, hit_record& rec) const override
 	{
 		// Move the ray backwards by the offset
-		const ray offset_r(r.origin() - offset_, r.direction(), r.time());
+		const ray offset_r = to_object(r);
 
 		// Determine whether an intersection exists along the offset ray (and if so, where)
 		if (!object_->hit(offset_r, ray_t, rec))
@@ -78,9 +109,20 @@ public:
 		return true;
 	}
 
+	bool occluded(const ray& r, const interval ray_t) const override
+	{
+		return object_->occluded(to_object(r), ray_t);
+	}
+
 	aabb bounding_box() const override { return bbox_; }
 
+	mat4 matrix() const { return mat4::translation(offset_); }
+
 private:
+	ray to_object(const ray& r) const { return {r.origin() - offset_, r.direction(), r.time()}; }
+
+	friend shared_ptr<hittable> fold_transforms(const shared_ptr<hittable>& object);
+
 	shared_ptr<hittable> object_;
 	vec3 offset_;
 	aabb bbox_;
@@ -131,20 +173,7 @@ public:
 	bool hit(const ray& r, interval ray_t, hit_record& rec) const override
 	{
 		// Transform the ray from world space to object space.
-
-		auto origin = point3(
-			(cos_theta * r.origin().x()) - (sin_theta * r.origin().z()),
-			r.origin().y(),
-			(sin_theta * r.origin().x()) + (cos_theta * r.origin().z())
-		);
-
-		auto direction = vec3(
-			(cos_theta * r.direction().x()) - (sin_theta * r.direction().z()),
-			r.direction().y(),
-			(sin_theta * r.direction().x()) + (cos_theta * r.direction().z())
-		);
-
-		ray rotated_r(origin, direction, r.time());
+		const ray rotated_r = to_object(r);
 
 		// Determine whether an intersection exists in object space (and if so, where).
 
@@ -170,9 +199,136 @@ public:
 
 	aabb bounding_box() const override { return bbox; }
 
+	bool occluded(const ray& r, const interval ray_t) const override
+	{
+		return object->occluded(to_object(r), ray_t);
+	}
+
+	mat4 matrix() const
+	{
+		mat4 r;
+		r.m[0][0] = cos_theta;
+		r.m[0][2] = sin_theta;
+		r.m[2][0] = -sin_theta;
+		r.m[2][2] = cos_theta;
+		return r;
+	}
+
 private:
+	friend shared_ptr<hittable> fold_transforms(const shared_ptr<hittable>& object);
+
+	ray to_object(const ray& r) const
+	{
+		auto origin = point3(
+			(cos_theta * r.origin().x()) - (sin_theta * r.origin().z()),
+			r.origin().y(),
+			(sin_theta * r.origin().x()) + (cos_theta * r.origin().z())
+		);
+
+		auto direction = vec3(
+			(cos_theta * r.direction().x()) - (sin_theta * r.direction().z()),
+			r.direction().y(),
+			(sin_theta * r.direction().x()) + (cos_theta * r.direction().z())
+		);
+
+		return {origin, direction, r.time()};
+	}
+
 	shared_ptr<hittable> object;
 	double sin_theta;
 	double cos_theta;
 	aabb bbox;
 };
+
+
+/// <summary>
+/// Places an object with one affine object-to-world matrix. The inverse and the normal matrix are
+/// precomputed, so any mix of translation, rotation (about any axis) and scaling costs a single
+/// ray transform on the way in and one point and normal transform on the way out.
+/// </summary>
+class transform : public hittable
+{
+public:
+	transform(shared_ptr<hittable> object, const mat4& matrix)
+		: object_(std::move(object)), matrix_(matrix), inverse_(matrix.inverse()),
+		  normal_matrix_(inverse_.transposed())
+	{
+		bbox_ = matrix_.transform_box(object_->bounding_box());
+	}
+
+	bool hit(const ray& r, interval ray_t, hit_record& rec) const override
+	{
+		if (!object_->hit(to_object(r), ray_t, rec))
+			return false;
+
+		// front_face keeps its meaning: dot(M d, M^-T n) == dot(d, n).
+		rec.p = matrix_.transform_point(rec.p);
+		rec.normal = unit_vector(normal_matrix_.transform_vector(rec.normal));
+
+		return true;
+	}
+
+	bool occluded(const ray& r, const interval ray_t) const override
+	{
+		return object_->occluded(to_object(r), ray_t);
+	}
+
+	aabb bounding_box() const override { return bbox_; }
+
+	const shared_ptr<hittable>& object() const { return object_; }
+	const mat4& matrix() const { return matrix_; }
+
+private:
+	ray to_object(const ray& r) const
+	{
+		// The direction is not renormalized, so ray parameters (and ray_t) mean the same thing in
+		// both spaces.
+		return {inverse_.transform_point(r.origin()), inverse_.transform_vector(r.direction()), r.time()};
+	}
+
+	shared_ptr<hittable> object_;
+	mat4 matrix_; // Object to world
+	mat4 inverse_; // World to object
+	mat4 normal_matrix_; // Inverse transpose of the linear part
+	aabb bbox_;
+};
+
+
+/// <summary>
+/// Scene-build pass: collapses a chain of translate / rotate_y / transform wrappers around one
+/// object into a single transform. Anything that isn't such a chain is returned unchanged.
+/// </summary>
+inline shared_ptr<hittable> fold_transforms(const shared_ptr<hittable>& object)
+{
+	mat4 matrix;
+	shared_ptr<hittable> inner = object;
+	int levels = 0;
+
+	while (true)
+	{
+		// Outer wrappers apply last, so each inner matrix multiplies on the right.
+		if (const auto* t = dynamic_cast<const translate*>(inner.get()))
+		{
+			matrix = matrix * t->matrix();
+			inner = t->object_;
+		}
+		else if (const auto* r = dynamic_cast<const rotate_y*>(inner.get()))
+		{
+			matrix = matrix * r->matrix();
+			inner = r->object;
+		}
+		else if (const auto* m = dynamic_cast<const transform*>(inner.get()))
+		{
+			matrix = matrix * m->matrix();
+			inner = m->object();
+		}
+		else
+			break;
+		levels++;
+	}
+
+	if (levels == 0 || (levels == 1 && dynamic_cast<const transform*>(object.get()) != nullptr))
+		return object;
+
+	return make_shared<transform>(inner, matrix);
+}
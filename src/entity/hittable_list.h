@@ -1,5 +1,8 @@
 #pragma once
 #include <memory>
+#include <vector>
+
+#include "entity/hittable.h"
 
 
 using std::make_shared;
@@ -24,23 +27,30 @@ public:
 
 	bool hit(const ray& r, interval ray_t, hit_record& rec) const override
 	{
-		hit_record temp_rec;
 		bool hit_anything = false;
 		auto closest_so_far = ray_t.max_;
 
+		// hit() only writes rec when it finds a closer hit (bvh_node relies on this too), so
+		// there is no need to go through a temporary record.
 		for (const auto& object : objects)
 		{
-			if (object->hit(r, interval(ray_t.min_, closest_so_far), temp_rec))
+			if (object->hit(r, interval(ray_t.min_, closest_so_far), rec))
 			{
 				hit_anything = true;
-				closest_so_far = temp_rec.t;
-				rec = temp_rec;
+				closest_so_far = rec.t;
 			}
 		}
 
 		return hit_anything;
 	}
 
+	bool occluded(const ray& r, const interval ray_t) const override
+	{
+		for (const auto& object : objects)
+			if (object->occluded(r, ray_t)) return true;
+		return false;
+	}
+
 	aabb bounding_box() const override { return bbox; }
 
 private:
@@ -0,0 +1,19 @@
+#pragma once
+
+#include "entity/hittable.h"
+
+
+/// <summary>
+/// One placement of shared geometry: a transform whose object is a bottom-level acceleration
+/// structure (usually a linear_bvh or bvh8) built once. Any number of instances can point at the
+/// same geometry, and a BVH built over the instances is the top level of a two-level hierarchy.
+/// The ray is transformed into object space once, on entry.
+/// </summary>
+class instance : public transform
+{
+public:
+	instance(shared_ptr<hittable> object, const mat4& object_to_world)
+		: transform(std::move(object), object_to_world)
+	{
+	}
+};
@@ -0,0 +1,68 @@
+#pragma once
+#include <utility>
+#include <vector>
+
+#include "entity/hittable_list.h"
+#include "entity/material.h"
+
+
+/// <summary>
+/// The emitters a camera samples explicitly for next-event estimation. Built at scene setup time
+/// from the scene's lists, before they disappear into BVHs: every quad, triangle or sphere with a
+/// diffuse_light material becomes a light. One light is picked uniformly per shading point.
+/// Lights are marked (hittable::mark_sampled_light) so that a bounce hitting one can tell it
+/// apart from emitters that are only found by bounces, such as those inside a BVH or transform.
+/// </summary>
+class light_list
+{
+public:
+	light_list() = default;
+
+	explicit light_list(const hittable_list& scene)
+	{
+		collect(scene);
+	}
+
+	void add(shared_ptr<hittable> light)
+	{
+		light->mark_sampled_light();
+		lights_.push_back(std::move(light));
+	}
+
+	bool empty() const { return lights_.empty(); }
+	size_t size() const { return lights_.size(); }
+
+	const hittable& pick() const
+	{
+		return *lights_[random_int(0, static_cast<int>(lights_.size()) - 1)];
+	}
+
+	// Probability of picking any one light.
+	double pick_probability() const { return 1.0 / static_cast<double>(lights_.size()); }
+
+	// Density of `direction`, for a ray at `time`, over the light sampling strategy as a whole.
+	double pdf_value(const point3& origin, const vec3& direction, const double time) const
+	{
+		double sum = 0;
+		for (const auto& light : lights_) sum += light->pdf_value(origin, direction, time);
+		return sum * pick_probability();
+	}
+
+private:
+	std::vector<shared_ptr<hittable>> lights_;
+
+	void collect(const hittable_list& list)
+	{
+		for (const auto& object : list.objects)
+		{
+			if (const auto* child = dynamic_cast<const hittable_list*>(object.get()))
+			{
+				collect(*child);
+				continue;
+			}
+
+			const material* mat = object->light_material();
+			if (mat != nullptr && mat->type == material_type::diffuse_light) add(object);
+		}
+	}
+};
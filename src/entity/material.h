@@ -1,129 +1,218 @@
 #pragma once
+#include <deque>
+
 #include "hittable.h"  // for hit_record definition (forward decl previously removed circular include)
 #include "texture.h"
+#include "math/onb.h"
 
 class ray;
 
+
+enum class material_type
+{
+	none, // Absorbs everything, emits nothing
+	lambertian,
+	metal,
+	dielectric,
+	diffuse_light,
+	isotropic
+};
+
+
+/// <summary>
+/// Tagged material record. Every kind shares this one layout and scatter() / emitted() switch on
+/// the tag, so a bounce costs no virtual call. A solid color is stored inline; `tex` is only set
+/// for real textures. lambertian, metal and the other kinds below are just constructors.
+/// </summary>
 class material
 {
 public:
-	virtual ~material() = default;
+	material_type type = material_type::none;
+	color albedo; // Reflectance (lambertian, metal, isotropic) or emission (diffuse_light)
+	shared_ptr<texture> tex; // Replaces albedo when set
+	double fuzz = 0; // metal
+	double refraction_index = 1; // dielectric
 
-	virtual bool scatter(
-		const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
-	) const
+	bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const
 	{
-		return false;
+		switch (type)
+		{
+		case material_type::lambertian:
+			{
+				// Cosine-weighted about the normal, so the attenuation is just the albedo.
+				const onb uvw(rec.normal);
+				const vec3 scatter_direction = uvw.transform(random_cosine_direction());
+
+				scattered = ray(rec.p, scatter_direction, r_in.time());
+				attenuation = albedo_at(rec.u, rec.v, rec.p);
+				return true;
+			}
+
+		case material_type::metal:
+			{
+				vec3 reflected = reflect(r_in.direction(), rec.normal);
+				reflected = unit_vector(reflected) + (fuzz * random_unit_vector()); // ģ������
+
+				scattered = ray(rec.p, reflected, r_in.time());
+				attenuation = albedo;
+				return (dot(scattered.direction(), rec.normal) > 0); // ɢ�䷽��ͷ���ͬ�࣬ɢ������Ĺ����յ�
+			}
+
+		case material_type::dielectric:
+			{
+				attenuation = color(1.0, 1.0, 1.0);
+				double ri = rec.front_face ? (1.0 / refraction_index) : refraction_index;
+
+				vec3 unit_direction = unit_vector(r_in.direction());
+
+				double cos_theta = std::fmin(dot(-unit_direction, rec.normal), 1.0);
+				double sin_theta = std::sqrt(1.0 - cos_theta * cos_theta);
+				bool cannot_refract = ri * sin_theta > 1.0;
+
+				vec3 direction;
+				if (cannot_refract || reflectance(cos_theta, ri) > random_double())
+					direction = reflect(unit_direction, rec.normal);
+				else
+					direction = refract(unit_direction, rec.normal, ri);
+				scattered = ray(rec.p, direction, r_in.time());
+
+				return true;
+			}
+
+		case material_type::isotropic:
+			scattered = ray(rec.p, random_unit_vector(), r_in.time()); // ���ɢ��
+			attenuation = albedo_at(rec.u, rec.v, rec.p);
+			return true;
+
+		default:
+			return false;
+		}
 	}
 
-	virtual color emitted(double u, double v, const point3& p) const
+	/// <summary>
+	/// Scattered radiance per unit incoming radiance from `direction`, cosine included, for the
+	/// kinds next-event estimation can sample lights from. Zero for everything else.
+	/// </summary>
+	color eval(const hit_record& rec, const vec3& direction) const
 	{
-		return {0, 0, 0};
+		switch (type)
+		{
+		case material_type::lambertian:
+			{
+				const auto cosine = dot(rec.normal, unit_vector(direction));
+				if (cosine <= 0) return {0, 0, 0};
+				return albedo_at(rec.u, rec.v, rec.p) * (cosine / pi);
+			}
+
+		case material_type::isotropic:
+			return albedo_at(rec.u, rec.v, rec.p) / (4 * pi);
+
+		default:
+			return {0, 0, 0};
+		}
 	}
-};
 
-
-class lambertian : public material
-{
-public:
-	lambertian(const color& albedo) : tex_(make_shared<solid_color>(albedo))
+	/// <summary>
+	/// Solid angle density with which scatter() picks `direction`. The specular kinds are delta
+	/// lobes with no density, so this is 0 for them as for the kinds that don't scatter.
+	/// </summary>
+	double pdf(const hit_record& rec, const vec3& direction) const
 	{
+		switch (type)
+		{
+		case material_type::lambertian:
+			{
+				const auto cosine = dot(rec.normal, unit_vector(direction));
+				return cosine > 0 ? cosine / pi : 0;
+			}
+
+		case material_type::isotropic:
+			return 1 / (4 * pi);
+
+		default:
+			return 0;
+		}
 	}
 
-	lambertian(shared_ptr<texture> tex) : tex_(std::move(tex))
+	// Mirror and glass (fuzzy metal included) are treated as delta lobes: light sampling can't
+	// reach them and they have no pdf.
+	bool is_specular() const
 	{
+		return type == material_type::metal || type == material_type::dielectric;
 	}
 
-
-	bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered)
-	const override
+	color emitted(double u, double v, const point3& p) const
 	{
-		auto scatter_direction = rec.normal + random_unit_vector();
+		if (type != material_type::diffuse_light) return {0, 0, 0};
+		return albedo_at(u, v, p);
+	}
 
-		// Catch degenerate scatter direction ����ɢ�䷽��ӽ�0�����
-		if (scatter_direction.near_zero()) scatter_direction = rec.normal;
+protected:
+	material() = default;
 
+	material(const material_type type, const color& albedo) : type(type), albedo(albedo)
+	{
+	}
 
-		scattered = ray(rec.p, scatter_direction, r_in.time());
-		attenuation = tex_->value(rec.u, rec.v, rec.p);
-		return true;
+	material(const material_type type, shared_ptr<texture> tex) : type(type), tex(std::move(tex))
+	{
 	}
 
 private:
-	color albedo;
-	shared_ptr<texture> tex_;
-};
-
-
-class metal : public material
-{
-public:
-	explicit metal(const color& albedo) : albedo(albedo), fuzz(0)
+	color albedo_at(double u, double v, const point3& p) const
 	{
+		return tex ? tex->value(u, v, p) : albedo;
 	}
 
-	metal(const color& albedo, double fuzz) : albedo(albedo), fuzz(fuzz < 1 ? fuzz : 1)
+	static double reflectance(double cosine, double refraction_index)
 	{
+		// Use Schlick's approximation for reflectance.
+		auto r0 = (1 - refraction_index) / (1 + refraction_index);
+		r0 = r0 * r0;
+		return r0 + (1 - r0) * std::pow((1 - cosine), 5);
 	}
+};
 
 
-	bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered)
-	const override
-	{
-		vec3 reflected = reflect(r_in.direction(), rec.normal);
-		reflected = unit_vector(reflected) + (fuzz * random_unit_vector()); // ģ������
+// The material kinds only set up the record; they must not add members, so a material can be
+// copied into a material_table (or through a base reference) without slicing anything off.
 
-		scattered = ray(rec.p, reflected, r_in.time());
-		attenuation = albedo;
-		return (dot(scattered.direction(), rec.normal) > 0); // ɢ�䷽��ͷ���ͬ�࣬ɢ������Ĺ����յ�
+class lambertian : public material
+{
+public:
+	lambertian(const color& albedo) : material(material_type::lambertian, albedo)
+	{
 	}
 
-private:
-	color albedo;
-	double fuzz;
+	lambertian(shared_ptr<texture> tex) : material(material_type::lambertian, std::move(tex))
+	{
+	}
 };
 
 
-class dielectric : public material
+class metal : public material
 {
 public:
-	dielectric(double refraction_index) : refraction_index(refraction_index)
+	explicit metal(const color& albedo) : material(material_type::metal, albedo)
 	{
 	}
 
-	bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered)
-	const override
+	metal(const color& albedo, double fuzz) : material(material_type::metal, albedo)
 	{
-		attenuation = color(1.0, 1.0, 1.0);
-		double ri = rec.front_face ? (1.0 / refraction_index) : refraction_index;
-
-		vec3 unit_direction = unit_vector(r_in.direction());
-
-		double cos_theta = std::fmin(dot(-unit_direction, rec.normal), 1.0);
-		double sin_theta = std::sqrt(1.0 - cos_theta * cos_theta);
-		bool cannot_refract = ri * sin_theta > 1.0;
-
-		vec3 direction;
-		if (cannot_refract || reflectance(cos_theta, ri) > random_double())
-			direction = reflect(unit_direction, rec.normal);
-		else
-			direction = refract(unit_direction, rec.normal, ri);
-		scattered = ray(rec.p, direction, r_in.time());
-
-		return true;
+		this->fuzz = fuzz < 1 ? fuzz : 1;
 	}
+};
 
-private:
+
+class dielectric : public material
+{
+public:
 	// Refractive index in vacuum or air, or the ratio of the material's refractive index over
 	// the refractive index of the enclosing media
-	double refraction_index;
-
-	static double reflectance(double cosine, double refraction_index)
+	dielectric(double refraction_index)
 	{
-		// Use Schlick's approximation for reflectance.
-		auto r0 = (1 - refraction_index) / (1 + refraction_index);
-		r0 = r0 * r0;
-		return r0 + (1 - r0) * std::pow((1 - cosine), 5);
+		type = material_type::dielectric;
+		this->refraction_index = refraction_index;
 	}
 };
 
@@ -131,43 +220,50 @@ private:
 class diffuse_light : public material
 {
 public:
-	diffuse_light(shared_ptr<texture> tex) : tex_(tex)
+	diffuse_light(shared_ptr<texture> tex) : material(material_type::diffuse_light, std::move(tex))
 	{
 	}
 
-	diffuse_light(const color& emit) : tex_(make_shared<solid_color>(emit))
+	diffuse_light(const color& emit) : material(material_type::diffuse_light, emit)
 	{
 	}
-
-	color emitted(double u, double v, const point3& p) const override
-	{
-		return tex_->value(u, v, p);
-	}
-
-private:
-	shared_ptr<texture> tex_;
 };
 
 
 class isotropic final : public material
 {
 public:
-	isotropic(const color& albedo) : tex_(make_shared<solid_color>(albedo))
+	isotropic(const color& albedo) : material(material_type::isotropic, albedo)
 	{
 	}
 
-	isotropic(shared_ptr<texture> tex) : tex_(tex)
+	isotropic(shared_ptr<texture> tex) : material(material_type::isotropic, std::move(tex))
 	{
 	}
+};
+
+
+static_assert(sizeof(lambertian) == sizeof(material) && sizeof(metal) == sizeof(material)
+              && sizeof(dielectric) == sizeof(material) && sizeof(diffuse_light) == sizeof(material)
+              && sizeof(isotropic) == sizeof(material), "material kinds must not add members");
 
-	bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered)
-	const override
+
+/// <summary>
+/// Scene-owned storage for materials. Records live next to each other in one container, and the
+/// shared_ptrs handed to primitives point into it while keeping the whole table alive.
+/// </summary>
+class material_table
+{
+public:
+	shared_ptr<material> add(const material& m)
 	{
-		scattered = ray(rec.p, random_unit_vector(), r_in.time()); // ���ɢ��
-		attenuation = tex_->value(rec.u, rec.v, rec.p);
-		return true;
+		// A deque never moves existing elements on push_back, so earlier pointers stay valid.
+		records_->push_back(m);
+		return {records_, &records_->back()};
 	}
 
+	size_t size() const { return records_->size(); }
+
 private:
-	shared_ptr<texture> tex_;
+	shared_ptr<std::deque<material>> records_ = make_shared<std::deque<material>>();
 };
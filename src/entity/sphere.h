@@ -2,6 +2,7 @@
 #include "hittable.h"
 #include "material.h"
 #include "math/aabb.h"
+#include "math/onb.h"
 #include "render/ray.h"
 class sphere : public hittable
 {
@@ -31,7 +32,66 @@ public:
 	{
 		point3 current_center = center_.at(r.time());
 
+		double root;
+		if (!nearest_root(r, ray_t, current_center, root)) return false;
 
+		rec.t = root;
+		rec.p = r.at(rec.t);
+		vec3 outward_normal = (rec.p - current_center) / radius_;
+		rec.set_face_normal(r, outward_normal);
+		get_sphere_uv(outward_normal, rec.u, rec.v);
+		rec.mat = mat_.get();
+		rec.sampled_light = sampled_light_;
+
+		return true;
+	}
+
+	bool occluded(const ray& r, const interval ray_t) const override
+	{
+		double root;
+		return nearest_root(r, ray_t, center_.at(r.time()), root);
+	}
+
+	aabb bounding_box() const override { return bbox_; }
+
+	const material* light_material() const override { return mat_.get(); }
+
+	void mark_sampled_light() override { sampled_light_ = true; }
+
+	double pdf_value(const point3& origin, const vec3& direction, const double time) const override
+	{
+		hit_record rec;
+		if (!hit(ray(origin, direction, time), interval(0.001, infinity), rec)) return 0;
+
+		// Uniform over the cone of directions that see the sphere, or over all directions when
+		// origin is inside it.
+		const auto distance_squared = (center_.at(time) - origin).length_squared();
+		if (distance_squared <= radius_ * radius_) return 1 / (4 * pi);
+
+		const auto cos_theta_max = std::sqrt(1 - radius_ * radius_ / distance_squared);
+		return 1 / (2 * pi * (1 - cos_theta_max));
+	}
+
+	vec3 random(const point3& origin, const double time) const override
+	{
+		const vec3 direction = center_.at(time) - origin;
+		const auto distance_squared = direction.length_squared();
+		if (distance_squared <= radius_ * radius_) return random_unit_vector();
+
+		const onb uvw(direction);
+		return uvw.transform(random_to_sphere(distance_squared));
+	}
+
+private:
+	ray center_; // ֧˶
+	double radius_;
+	shared_ptr<material> mat_;
+	aabb bbox_;
+	bool sampled_light_ = false;
+
+
+	bool nearest_root(const ray& r, const interval& ray_t, const point3& current_center, double& root) const
+	{
 		vec3 oc = current_center - r.origin();
 		auto a = r.direction().length_squared();
 		auto h = dot(r.direction(), oc);
@@ -43,30 +103,30 @@ public:
 		const auto sqrt_d = std::sqrt(discriminant);
 
 		// Find the nearest root that lies in the acceptable range.
-		auto root = (h - sqrt_d) / a;
+		root = (h - sqrt_d) / a;
 		if (!ray_t.surrounds(root))
 		{
 			root = (h + sqrt_d) / a;
 			if (!ray_t.surrounds(root)) return false;
 		}
-
-		rec.t = root;
-		rec.p = r.at(rec.t);
-		vec3 outward_normal = (rec.p - current_center) / radius_;
-		rec.set_face_normal(r, outward_normal);
-		get_sphere_uv(outward_normal, rec.u, rec.v);
-		rec.mat = mat_;
-
 		return true;
 	}
 
-	aabb bounding_box() const override { return bbox_; }
 
-private:
-	ray center_; // ֧˶
-	double radius_;
-	shared_ptr<material> mat_;
-	aabb bbox_;
+	// Uniform direction inside the cone subtended by the sphere, in a frame whose z axis points
+	// at the center.
+	vec3 random_to_sphere(const double distance_squared) const
+	{
+		const auto r1 = random_double();
+		const auto r2 = random_double();
+		const auto z = 1 + r2 * (std::sqrt(1 - radius_ * radius_ / distance_squared) - 1);
+
+		const auto phi = 2 * pi * r1;
+		const auto x = std::cos(phi) * std::sqrt(1 - z * z);
+		const auto y = std::sin(phi) * std::sqrt(1 - z * z);
+
+		return {x, y, z};
+	}
 
 
 	/// <summary>
@@ -13,6 +13,7 @@ public:
 		normal_ = unit_vector(n);
 		d_ = dot(normal_, Q);
 		w_ = n / dot(n, n);
+		area_ = 0.5 * n.length();
 
 		triangle::set_bounding_box();
 	}
@@ -29,32 +30,59 @@ public:
 
 	bool hit(const ray& r, const interval ray_t, hit_record& rec) const override
 	{
-		const auto denom = dot(normal_, r.direction()); //  t ķĸ
+		double t, alpha, beta;
+		if (!plane_hit(r, ray_t, t, alpha, beta)) return false;
 
-		// No hit if the ray is parallel to the plane.  ƽƽУûн
-		if (std::fabs(denom) < 1e-8) return false;
+		if (!is_interior(alpha, beta, rec)) return false;
 
-		// Return false if the hit point parameter t is outside the ray interval.
-		auto t = (d_ - dot(normal_, r.origin())) / denom;
-		if (!ray_t.contains(t))
-			return false;
 
-		const auto intersection = r.at(t); // 
+		rec.t = t;
+		rec.p = r.at(t);
+		rec.mat = mat_.get();
+		rec.sampled_light = sampled_light_;
+		rec.set_face_normal(r, normal_);
+
+		return true;
+	}
 
 
-		const vec3 planar_hitpt_vector = intersection - q_;
-		const auto alpha = dot(w_, cross(planar_hitpt_vector, v_));
-		const auto beta = dot(w_, cross(u_, planar_hitpt_vector));
+	bool occluded(const ray& r, const interval ray_t) const override
+	{
+		double t, alpha, beta;
+		if (!plane_hit(r, ray_t, t, alpha, beta)) return false;
 
-		if (!is_interior(alpha, beta, rec)) return false;
+		// is_interior also writes uv; a scratch record takes it.
+		hit_record scratch;
+		return is_interior(alpha, beta, scratch);
+	}
 
 
-		rec.t = t;
-		rec.p = intersection;
-		rec.mat = mat_;
-		rec.set_face_normal(r, normal_);
+	const material* light_material() const override { return mat_.get(); }
 
-		return true;
+	void mark_sampled_light() override { sampled_light_ = true; }
+
+	double pdf_value(const point3& origin, const vec3& direction, double /*time*/) const override
+	{
+		hit_record rec;
+		if (!hit(ray(origin, direction), interval(0.001, infinity), rec)) return 0;
+
+		// Uniform area density 1/A, seen as a solid angle density from origin.
+		const auto distance_squared = rec.t * rec.t * direction.length_squared();
+		const auto cosine = std::fabs(dot(direction, rec.normal) / direction.length());
+		return distance_squared / (cosine * area_);
+	}
+
+	vec3 random(const point3& origin, double /*time*/) const override
+	{
+		auto a = random_double();
+		auto b = random_double();
+		if (a + b > 1)
+		{
+			// Fold the far half of the parallelogram back onto the triangle.
+			a = 1 - a;
+			b = 1 - b;
+		}
+		return q_ + (a * u_) + (b * v_) - origin;
 	}
 
 
@@ -68,13 +96,38 @@ public:
 	}
 
 private:
+	// Intersects the ray with the primitive's plane; alpha and beta are the hit point's
+	// coordinates along u_ and v_.
+	bool plane_hit(const ray& r, const interval& ray_t, double& t, double& alpha, double& beta) const
+	{
+		const auto denom = dot(normal_, r.direction()); //  t ķĸ
+
+		// No hit if the ray is parallel to the plane.  ƽƽУûн
+		if (std::fabs(denom) < 1e-8) return false;
+
+		// Return false if the hit point parameter t is outside the ray interval.
+		t = (d_ - dot(normal_, r.origin())) / denom;
+		if (!ray_t.contains(t))
+			return false;
+
+		const auto intersection = r.at(t); // 
+
+
+		const vec3 planar_hitpt_vector = intersection - q_;
+		alpha = dot(w_, cross(planar_hitpt_vector, v_));
+		beta = dot(w_, cross(u_, planar_hitpt_vector));
+		return true;
+	}
+
 	point3 q_; // ԭ
 	vec3 u_, v_; // 
 	vec3 w_;
 
 	shared_ptr<material> mat_;
 	aabb bbox_;
+	bool sampled_light_ = false;
 
 	vec3 normal_;
 	double d_;
+	double area_;
 };
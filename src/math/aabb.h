@@ -46,27 +46,21 @@ public:
 
 	bool hit(const ray& r, interval ray_t) const
 	{
+		// Division-free slab test: the ray carries its reciprocal direction, and its direction
+		// signs pick the near and far plane of each slab up front.
 		const point3& ray_orig = r.origin();
-		const vec3& ray_dir = r.direction();
+		const vec3& inv_dir = r.inv_direction();
 
 		for (int axis = 0; axis < 3; axis++)
 		{
 			const interval& ax = axis_interval(axis);
-			const double adinv = 1.0 / ray_dir[axis];
-
-			auto t0 = (ax.min_ - ray_orig[axis]) * adinv; // ʱ
-			auto t1 = (ax.max_ - ray_orig[axis]) * adinv; // ȥʱ
-
-			if (t0 < t1)
-			{
-				if (t0 > ray_t.min_) ray_t.min_ = t0; // ʱȡֵ
-				if (t1 < ray_t.max_) ray_t.max_ = t1; // ȥʱȡСֵ
-			}
-			else // ڷ
-			{
-				if (t1 > ray_t.min_) ray_t.min_ = t1;
-				if (t0 < ray_t.max_) ray_t.max_ = t0;
-			}
+			const bool negative = r.sign(axis);
+
+			auto t0 = ((negative ? ax.max_ : ax.min_) - ray_orig[axis]) * inv_dir[axis]; // ʱ
+			auto t1 = ((negative ? ax.min_ : ax.max_) - ray_orig[axis]) * inv_dir[axis]; // ȥʱ
+
+			if (t0 > ray_t.min_) ray_t.min_ = t0; // ʱȡֵ
+			if (t1 < ray_t.max_) ray_t.max_ = t1; // ȥʱȡСֵ
 
 			if (ray_t.max_ <= ray_t.min_) // ûн
 				return false;
@@ -74,6 +68,21 @@ public:
 		return true;
 	}
 
+	double surface_area() const
+	{
+		// Returns the total area of the six faces. Used by the SAH builder as the relative
+		// probability that a ray passing through the parent also passes through this box.
+		const auto dx = x.size();
+		const auto dy = y.size();
+		const auto dz = z.size();
+		return 2 * (dx * dy + dy * dz + dz * dx);
+	}
+
+	point3 centroid() const
+	{
+		return {0.5 * (x.min_ + x.max_), 0.5 * (y.min_ + y.max_), 0.5 * (z.min_ + z.max_)};
+	}
+
 	int longest_axis() const
 	{
 		// Returns the index of the longest axis of the bounding box.
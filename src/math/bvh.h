@@ -1,15 +1,106 @@
 #pragma once
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <thread>
 
 #include "entity/hittable.h"
 #include "entity/hittable_list.h"
+#include "utils/parallel.h"
+
+
+enum class bvh_split_method
+{
+	median, // Split at the object-count midpoint along the longest axis
+	sah, // Binned surface area heuristic
+	morton // Linear BVH over the Morton order of the centroids, for fast per-frame rebuilds
+};
+
+
+struct bvh_build_options
+{
+	bvh_split_method method = bvh_split_method::median;
+
+	// SAH parameters. Costs are relative; only their ratio matters when choosing a split, but
+	// their absolute values decide when a span is cheaper as a leaf than as another node.
+	int sah_bins = 16; // Number of centroid buckets evaluated per axis
+	double traversal_cost = 0.125; // Cost of visiting an interior node
+	double intersection_cost = 1.0; // Cost of intersecting one object
+	size_t max_leaf_objects = 4; // Largest span the SAH builder may keep as a single leaf
+
+	// Parallel build. Subtrees with at least this many objects are handed to another worker
+	// while one is free, and spans at least this large bin and partition their objects in
+	// parallel chunks.
+	size_t parallel_subtree_threshold = 4096;
+	size_t parallel_partition_threshold = 65536;
+
+	// Morton build
+	int morton_bits = 30; // Code length: 30 (10 bits per axis) or 63 (21 bits per axis)
+	int treelet_size = 0; // Leaves per treelet in the restructuring pass after it (0: off, max 8)
+};
+
+
+// Single-precision copies of box bounds for the compact BVH layouts. Rounding outwards keeps the
+// float box enclosing the double-precision one.
+
+inline float float_round_down(const double x)
+{
+	auto f = static_cast<float>(x);
+	if (static_cast<double>(f) > x) f = std::nextafter(f, -std::numeric_limits<float>::infinity());
+	return f;
+}
+
+inline float float_round_up(const double x)
+{
+	auto f = static_cast<float>(x);
+	if (static_cast<double>(f) < x) f = std::nextafter(f, std::numeric_limits<float>::infinity());
+	return f;
+}
+
+
+// Morton codes interleave the bits of the three quantized coordinates, x in the highest bit of
+// each triple, so sorting by code orders points along a Z-order curve.
+
+inline uint64_t morton_spread_bits(uint64_t v)
+{
+	// Moves bit k of a 21-bit value to bit 3k.
+	v &= 0x1fffff;
+	v = (v | v << 32) & 0x1f00000000ffffull;
+	v = (v | v << 16) & 0x1f0000ff0000ffull;
+	v = (v | v << 8) & 0x100f00f00f00f00full;
+	v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+	v = (v | v << 2) & 0x1249249249249249ull;
+	return v;
+}
+
+inline uint64_t morton_encode(const uint64_t x, const uint64_t y, const uint64_t z)
+{
+	return morton_spread_bits(x) << 2 | morton_spread_bits(y) << 1 | morton_spread_bits(z);
+}
+
+inline int count_leading_zeros(uint64_t x)
+{
+	if (x == 0) return 64;
+	int n = 0;
+	if (x <= 0x00000000ffffffffull) { n += 32; x <<= 32; }
+	if (x <= 0x0000ffffffffffffull) { n += 16; x <<= 16; }
+	if (x <= 0x00ffffffffffffffull) { n += 8; x <<= 8; }
+	if (x <= 0x0fffffffffffffffull) { n += 4; x <<= 4; }
+	if (x <= 0x3fffffffffffffffull) { n += 2; x <<= 2; }
+	if (x <= 0x7fffffffffffffffull) { n += 1; }
+	return n;
+}
 
 
 class bvh_node : public hittable
 {
 public:
-	bvh_node(hittable_list list) : bvh_node(list.objects, 0, list.objects.size())
+	bvh_node(hittable_list list, const bvh_build_options& options = {})
+		: bvh_node(list.objects, 0, list.objects.size(), options)
 	{
 		// There's a C++ subtlety here. This constructor (without span indices) creates an
 		// implicit copy of the hittable list, which we will modify. The lifetime of the copied
@@ -17,13 +108,231 @@ public:
 		// persist the resulting bounding volume hierarchy.
 	}
 
-	bvh_node(std::vector<shared_ptr<hittable>>& objects, size_t start, size_t end)
+	bvh_node(std::vector<shared_ptr<hittable>>& objects, size_t start, size_t end,
+	         const bvh_build_options& options = {})
+	{
+		build_context context;
+		context.max_workers = worker_thread_count();
+		if (options.method == bvh_split_method::morton)
+			build_morton(objects, start, end, options, context);
+		else
+			build(objects, start, end, options, context);
+	}
+
+	bool hit(const ray& r, interval ray_t, hit_record& rec) const override
+	{
+		if (!bbox.hit(r, ray_t))
+			return false;
+
+		if (right == left) return left->hit(r, ray_t, rec);
+
+		// All builders put the child with the lower centroids along the split axis on the left,
+		// so the direction sign tells which child the ray reaches first. Visiting it first lets a
+		// hit there shrink the interval until the far child's own box test rejects it.
+		const bool reversed = r.sign(axis);
+		const hittable& near_child = reversed ? *right : *left;
+		const hittable& far_child = reversed ? *left : *right;
+
+		bool hit_near = near_child.hit(r, ray_t, rec);
+		bool hit_far = far_child.hit(r, interval(ray_t.min_, hit_near ? rec.t : ray_t.max_), rec);
+
+		return hit_near || hit_far;
+	}
+
+	bool occluded(const ray& r, const interval ray_t) const override
+	{
+		if (!bbox.hit(r, ray_t))
+			return false;
+
+		if (right == left) return left->occluded(r, ray_t);
+
+		// Any hit will do, but the near child is still the likelier one to block the ray.
+		const bool reversed = r.sign(axis);
+		const hittable& near_child = reversed ? *right : *left;
+		const hittable& far_child = reversed ? *left : *right;
+
+		return near_child.occluded(r, ray_t) || far_child.occluded(r, ray_t);
+	}
+
+	aabb bounding_box() const override { return bbox; }
+
+private:
+	struct build_tag
+	{
+	};
+
+public:
+	// Empty node filled in by build(); public only so make_shared can reach it.
+	explicit bvh_node(build_tag)
+	{
+	}
+
+private:
+	friend class linear_bvh;
+	template <int W> friend class wide_bvh;
+
+	shared_ptr<hittable> left;
+	shared_ptr<hittable> right;
+	aabb bbox;
+	int axis = 0; // Split axis; the left child lies on its low side
+
+	static constexpr int max_inline_bins = 32; // Most SAH bins per axis kept on the stack
+
+	// Shared by every node of one build: how many workers are currently building subtrees.
+	struct build_context
+	{
+		std::atomic<int> active_workers{1};
+		int max_workers = 1;
+
+		bool try_acquire_worker()
+		{
+			int active = active_workers.load();
+			while (active < max_workers)
+				if (active_workers.compare_exchange_weak(active, active + 1)) return true;
+			return false;
+		}
+
+		void release_worker() { active_workers.fetch_sub(1); }
+
+		// Runs both tasks, the first on another worker if it is large enough and one is free.
+		template <typename FirstTask, typename SecondTask>
+		void fork_join(bool large, FirstTask&& first, SecondTask&& second)
+		{
+			if (large && try_acquire_worker())
+			{
+				task_group group;
+				group.run(first);
+				second();
+				group.wait();
+				release_worker();
+			}
+			else
+			{
+				first();
+				second();
+			}
+		}
+	};
+
+	struct morton_primitive
+	{
+		uint64_t code;
+		uint32_t index; // Into the span being built
+	};
+
+	// Interior node of the index-based tree a Morton build produces before it is turned into
+	// bvh_nodes. Leaves are the sorted objects themselves.
+	struct lbvh_node
+	{
+		uint32_t child[2];
+		bool child_is_leaf[2];
+		int axis;
+		uint32_t first_leaf; // Start of the leaf range the radix tree gave this node
+		aabb bbox;
+		size_t leaf_count;
+	};
+
+	struct lbvh_reference
+	{
+		uint32_t index; // Into lbvh_tree::nodes, or the sorted objects for leaves
+		bool is_leaf;
+	};
+
+	struct lbvh_tree
 	{
+		std::vector<lbvh_node> nodes; // nodes[0] is the root
+		std::vector<aabb> leaf_boxes;
+		const bvh_build_options* options;
+
+		const aabb& box(uint32_t index, bool is_leaf) const { return is_leaf ? leaf_boxes[index] : nodes[index].bbox; }
+		size_t leaf_count(uint32_t index, bool is_leaf) const { return is_leaf ? 1 : nodes[index].leaf_count; }
+	};
+
+	void build(
+		std::vector<shared_ptr<hittable>>& objects, size_t start, size_t end,
+		const bvh_build_options& options, build_context& context
+	)
+	{
+		size_t object_span = end - start;
+
 		// Build the bounding box of the span of source objects.
 		bbox = aabb::empty;
-		for (size_t object_index = start; object_index < end; object_index++)
-			bbox = aabb(bbox, objects[object_index]->bounding_box());
-		int axis = bbox.longest_axis();
+		if (object_span < options.parallel_partition_threshold)
+		{
+			for (size_t object_index = start; object_index < end; object_index++)
+				bbox = aabb(bbox, objects[object_index]->bounding_box());
+		}
+		else
+		{
+			const size_t grain = chunk_grain(object_span, options);
+			std::vector<aabb> chunk_boxes((object_span + grain - 1) / grain, aabb::empty);
+			parallel_for_chunks(object_span, grain, [&](size_t chunk, size_t begin, size_t chunk_end)
+			{
+				for (size_t object_index = start + begin; object_index < start + chunk_end; object_index++)
+					chunk_boxes[chunk] = aabb(chunk_boxes[chunk], objects[object_index]->bounding_box());
+			});
+			for (const auto& box : chunk_boxes) bbox = aabb(bbox, box);
+		}
+
+		if (object_span == 1) left = right = objects[start];
+		else if (object_span == 2)
+		{
+			// Order the pair along the axis that separates their centers most, lower one first.
+			const vec3 offset = objects[start + 1]->bounding_box().centroid() - objects[start]->bounding_box().centroid();
+			axis = 0;
+			for (int a = 1; a < 3; a++)
+				if (std::fabs(offset[a]) > std::fabs(offset[axis])) axis = a;
+			const bool swapped = offset[axis] < 0;
+			left = objects[swapped ? start + 1 : start];
+			right = objects[swapped ? start : start + 1];
+		}
+		else
+		{
+			size_t mid = start;
+			if (options.method == bvh_split_method::sah)
+				mid = sah_split(objects, start, end, bbox, options, axis);
+
+			if (mid == end)
+			{
+				// The SAH found no split cheaper than testing every object in the span.
+				auto leaf = make_shared<hittable_list>();
+				for (size_t object_index = start; object_index < end; object_index++)
+					leaf->add(objects[object_index]);
+				left = right = leaf;
+				return;
+			}
+
+			if (mid == start) mid = median_split(objects, start, end, bbox, axis);
+
+			// Children work on disjoint spans of `objects`, so a large left subtree can be built
+			// on another worker while this thread builds the right one.
+			auto left_node = make_shared<bvh_node>(build_tag());
+			auto right_node = make_shared<bvh_node>(build_tag());
+
+			context.fork_join(
+				mid - start >= options.parallel_subtree_threshold,
+				[&]() { left_node->build(objects, start, mid, options, context); },
+				[&]() { right_node->build(objects, mid, end, options, context); }
+			);
+
+			left = left_node;
+			right = right_node;
+		}
+	}
+
+	static size_t chunk_grain(size_t object_span, const bvh_build_options& options)
+	{
+		// Spans below the threshold are processed as a single chunk on the calling thread.
+		if (object_span < options.parallel_partition_threshold) return object_span == 0 ? 1 : object_span;
+		const size_t chunks = 4 * static_cast<size_t>(worker_thread_count());
+		return (object_span + chunks - 1) / chunks;
+	}
+
+	static size_t median_split(
+		std::vector<shared_ptr<hittable>>& objects, size_t start, size_t end, const aabb& bbox, int& axis
+	)
+	{
+		axis = bbox.longest_axis();
 
 		auto comparator = (axis == 0)
 			                  ? box_x_compare
@@ -31,41 +340,556 @@ public:
 			                  ? box_y_compare
 			                  : box_z_compare;
 
-		size_t object_span = end - start;
+		// Only the partition around the middle element matters, not a full sort of the span.
+		const size_t mid = start + (end - start) / 2;
+		std::nth_element(std::begin(objects) + start, std::begin(objects) + mid, std::begin(objects) + end, comparator);
 
-		if (object_span == 1) left = right = objects[start];
-		else if (object_span == 2)
+		return mid;
+	}
+
+	/// <summary>
+	/// Binned SAH split. Partitions the span in place and returns the first index of the right
+	/// half, `end` if the span should become a leaf, or `start` if no usable split was found.
+	/// </summary>
+	static size_t sah_split(
+		std::vector<shared_ptr<hittable>>& objects, size_t start, size_t end, const aabb& bbox,
+		const bvh_build_options& options, int& split_axis
+	)
+	{
+		struct bin
 		{
-			left = objects[start];
-			right = objects[start + 1];
-		}
+			aabb bounds = aabb::empty;
+			size_t count = 0;
+		};
+
+		const size_t object_span = end - start;
+		const int bin_count = options.sah_bins < 2 ? 2 : options.sah_bins;
+
+		const size_t grain = chunk_grain(object_span, options);
+		const size_t chunk_count = (object_span + grain - 1) / grain;
+
+		// Objects are binned by centroid, so bins are laid out over the centroid bounds rather
+		// than over the (usually much larger) bounds of the objects themselves.
+		auto extend_centroids = [&](interval* extent, size_t begin, size_t chunk_end)
+		{
+			for (size_t object_index = start + begin; object_index < start + chunk_end; object_index++)
+			{
+				const auto c = objects[object_index]->bounding_box().centroid();
+				for (int axis = 0; axis < 3; axis++)
+					extent[axis] = interval(extent[axis], interval(c[axis], c[axis]));
+			}
+		};
+
+		interval centroid_extent[3];
+		if (chunk_count == 1) extend_centroids(centroid_extent, 0, object_span);
 		else
 		{
-			std::sort(std::begin(objects) + start, std::begin(objects) + end, comparator);
+			std::vector<std::array<interval, 3>> chunk_extents(chunk_count);
+			parallel_for_chunks(object_span, grain, [&](size_t chunk, size_t begin, size_t chunk_end)
+			{
+				extend_centroids(chunk_extents[chunk].data(), begin, chunk_end);
+			});
+
+			for (const auto& extent : chunk_extents)
+				for (int axis = 0; axis < 3; axis++)
+					centroid_extent[axis] = interval(centroid_extent[axis], extent[axis]);
+		}
+
+		double bin_scale[3];
+		for (int axis = 0; axis < 3; axis++)
+			bin_scale[axis] = centroid_extent[axis].size() > 0 ? bin_count / centroid_extent[axis].size() : 0;
+
+		auto bin_index = [&](double centroid, int axis)
+		{
+			auto b = static_cast<int>((centroid - centroid_extent[axis].min_) * bin_scale[axis]);
+			return b >= bin_count ? bin_count - 1 : b;
+		};
+
+		// Bin all three axes in one pass over the objects, one set of bins per chunk. A span done
+		// in one chunk, which is most nodes, keeps its bins on the stack unless there are
+		// unusually many.
+		bin inline_bins[3 * max_inline_bins];
+		double inline_weight[max_inline_bins];
+		std::vector<bin> bin_storage;
+		std::vector<double> weight_storage;
+		bin* chunk_bins = inline_bins;
+		double* right_weight = inline_weight;
+		if (chunk_count > 1 || bin_count > max_inline_bins)
+		{
+			bin_storage.resize(chunk_count * 3 * bin_count);
+			weight_storage.resize(bin_count);
+			chunk_bins = bin_storage.data();
+			right_weight = weight_storage.data();
+		}
+
+		parallel_for_chunks(object_span, grain, [&](size_t chunk, size_t begin, size_t chunk_end)
+		{
+			bin* bins = &chunk_bins[chunk * 3 * bin_count];
+			for (size_t object_index = start + begin; object_index < start + chunk_end; object_index++)
+			{
+				const auto box = objects[object_index]->bounding_box();
+				const auto c = box.centroid();
+				for (int axis = 0; axis < 3; axis++)
+				{
+					bin& b = bins[axis * bin_count + bin_index(c[axis], axis)];
+					b.bounds = aabb(b.bounds, box);
+					b.count++;
+				}
+			}
+		});
 
-			auto mid = start + object_span / 2;
-			left = make_shared<bvh_node>(objects, start, mid);
-			right = make_shared<bvh_node>(objects, mid, end);
+		const double parent_area = bbox.surface_area();
+		double best_cost = infinity;
+		int best_axis = -1;
+		int best_split = 0;
+
+		std::vector<bin> merged_bins(chunk_count > 1 ? bin_count : 0);
+
+		for (int axis = 0; axis < 3; axis++)
+		{
+			if (!(centroid_extent[axis].size() > 0)) continue;
+
+			const bin* bins = &chunk_bins[axis * bin_count];
+			if (chunk_count > 1)
+			{
+				for (int b = 0; b < bin_count; b++)
+				{
+					merged_bins[b] = bin();
+					for (size_t chunk = 0; chunk < chunk_count; chunk++)
+					{
+						const bin& partial = chunk_bins[(chunk * 3 + axis) * bin_count + b];
+						merged_bins[b].bounds = aabb(merged_bins[b].bounds, partial.bounds);
+						merged_bins[b].count += partial.count;
+					}
+				}
+				bins = merged_bins.data();
+			}
+
+			// Sweep from the right to get count * area of every suffix, then from the left to
+			// evaluate each of the bin_count - 1 candidate planes.
+			aabb right_bounds = aabb::empty;
+			size_t right_count = 0;
+			for (int split = bin_count - 1; split > 0; split--)
+			{
+				right_bounds = aabb(right_bounds, bins[split].bounds);
+				right_count += bins[split].count;
+				right_weight[split - 1] = right_count ? right_count * right_bounds.surface_area() : 0;
+			}
+
+			aabb left_bounds = aabb::empty;
+			size_t left_count = 0;
+			for (int split = 0; split < bin_count - 1; split++)
+			{
+				left_bounds = aabb(left_bounds, bins[split].bounds);
+				left_count += bins[split].count;
+				if (left_count == 0 || left_count == object_span) continue;
+
+				const double cost = options.traversal_cost + options.intersection_cost
+					* (left_count * left_bounds.surface_area() + right_weight[split]) / parent_area;
+
+				if (cost < best_cost)
+				{
+					best_cost = cost;
+					best_axis = axis;
+					best_split = split;
+				}
+			}
 		}
+
+		if (best_axis < 0) return start;
+
+		const double leaf_cost = options.intersection_cost * object_span;
+		if (object_span <= options.max_leaf_objects && leaf_cost <= best_cost) return end;
+
+		auto on_left = [&](const shared_ptr<hittable>& object)
+		{
+			return bin_index(object->bounding_box().centroid()[best_axis], best_axis) <= best_split;
+		};
+
+		const size_t mid_index = chunk_count > 1
+			                         ? parallel_partition(objects, start, end, on_left, grain)
+			                         : static_cast<size_t>(
+				                         std::partition(std::begin(objects) + start, std::begin(objects) + end, on_left)
+				                         - std::begin(objects));
+
+		if (mid_index == start || mid_index == end) return start;
+
+		split_axis = best_axis;
+		return mid_index;
 	}
 
-	bool hit(const ray& r, interval ray_t, hit_record& rec) const override
+	/// <summary>
+	/// Linear BVH build: sorts the objects by the Morton code of their centroid, then derives every
+	/// interior node independently from the sorted codes (Karras 2012), so the hierarchy costs
+	/// linear time after the radix sort. An optional treelet pass then reshapes small groups of
+	/// nodes for a lower SAH cost.
+	/// </summary>
+	void build_morton(
+		std::vector<shared_ptr<hittable>>& objects, size_t start, size_t end,
+		const bvh_build_options& options, build_context& context
+	)
 	{
-		if (!bbox.hit(r, ray_t))
-			return false;
+		const size_t object_span = end - start;
+		if (object_span == 1)
+		{
+			left = right = objects[start];
+			bbox = left->bounding_box();
+			return;
+		}
+
+		const size_t grain = chunk_grain(object_span, options);
+		const size_t chunk_count = (object_span + grain - 1) / grain;
+
+		lbvh_tree tree;
+		tree.options = &options;
+		tree.leaf_boxes.resize(object_span);
+
+		std::vector<aabb> chunk_centroid_bounds(chunk_count, aabb::empty);
+		parallel_for_chunks(object_span, grain, [&](size_t chunk, size_t begin, size_t chunk_end)
+		{
+			for (size_t i = begin; i < chunk_end; i++)
+			{
+				tree.leaf_boxes[i] = objects[start + i]->bounding_box();
+				const auto c = tree.leaf_boxes[i].centroid();
+				chunk_centroid_bounds[chunk] = aabb(chunk_centroid_bounds[chunk], aabb(c, c));
+			}
+		});
+		aabb centroid_bounds = aabb::empty;
+		for (const auto& box : chunk_centroid_bounds) centroid_bounds = aabb(centroid_bounds, box);
+
+		const int bits_per_axis = options.morton_bits > 30 ? 21 : 10;
+		const double cells = static_cast<double>(1u << bits_per_axis);
+		double scale[3];
+		for (int a = 0; a < 3; a++)
+		{
+			const double size = centroid_bounds.axis_interval(a).size();
+			scale[a] = size > 0 ? cells / size : 0;
+		}
+
+		std::vector<morton_primitive> primitives(object_span);
+		parallel_for_chunks(object_span, grain, [&](size_t, size_t begin, size_t chunk_end)
+		{
+			for (size_t i = begin; i < chunk_end; i++)
+			{
+				const auto c = tree.leaf_boxes[i].centroid();
+				uint64_t q[3];
+				for (int a = 0; a < 3; a++)
+				{
+					const double cell = (c[a] - centroid_bounds.axis_interval(a).min_) * scale[a];
+					q[a] = cell >= cells ? (1u << bits_per_axis) - 1 : static_cast<uint64_t>(cell);
+				}
+				primitives[i] = {morton_encode(q[0], q[1], q[2]), static_cast<uint32_t>(i)};
+			}
+		});
 
-		bool hit_left = left->hit(r, ray_t, rec);
-		bool hit_right = right->hit(r, interval(ray_t.min_, hit_left ? rec.t : ray_t.max_), rec);
+		radix_sort(primitives, 3 * bits_per_axis, grain);
 
-		return hit_left || hit_right;
+		// Put the objects (and their boxes) in Morton order; leaf k of the tree is object start + k.
+		{
+			std::vector<shared_ptr<hittable>> sorted_objects(object_span);
+			std::vector<aabb> sorted_boxes(object_span);
+			parallel_for_chunks(object_span, grain, [&](size_t, size_t begin, size_t chunk_end)
+			{
+				for (size_t i = begin; i < chunk_end; i++)
+				{
+					sorted_objects[i] = std::move(objects[start + primitives[i].index]);
+					sorted_boxes[i] = tree.leaf_boxes[primitives[i].index];
+				}
+			});
+			std::move(sorted_objects.begin(), sorted_objects.end(), std::begin(objects) + start);
+			tree.leaf_boxes = std::move(sorted_boxes);
+		}
+
+		tree.nodes.resize(object_span - 1);
+		parallel_for_chunks(object_span - 1, grain, [&](size_t, size_t begin, size_t chunk_end)
+		{
+			for (size_t i = begin; i < chunk_end; i++)
+				tree.nodes[i] = lbvh_interior_node(primitives, static_cast<int64_t>(i), 3 * bits_per_axis);
+		});
+
+		finish_lbvh_subtree(tree, 0, context);
+
+		emit_lbvh(tree, 0, objects, start, context);
 	}
 
-	aabb bounding_box() const override { return bbox; }
+	/// <summary>
+	/// Stable LSD radix sort on the low `bits` bits of the codes, 8 bits per pass. Every chunk
+	/// counts its digits in parallel, and the per-chunk offsets let the chunks scatter in parallel.
+	/// </summary>
+	static void radix_sort(std::vector<morton_primitive>& items, int bits, size_t grain)
+	{
+		constexpr int digit_bits = 8;
+		constexpr size_t bucket_count = size_t(1) << digit_bits;
 
-private:
-	shared_ptr<hittable> left;
-	shared_ptr<hittable> right;
-	aabb bbox;
+		const size_t count = items.size();
+		const size_t chunk_count = (count + grain - 1) / grain;
+		std::vector<morton_primitive> scratch(count);
+		std::vector<size_t> offsets(chunk_count * bucket_count);
+
+		for (int shift = 0; shift < bits; shift += digit_bits)
+		{
+			std::fill(offsets.begin(), offsets.end(), 0);
+			parallel_for_chunks(count, grain, [&](size_t chunk, size_t begin, size_t chunk_end)
+			{
+				size_t* histogram = &offsets[chunk * bucket_count];
+				for (size_t i = begin; i < chunk_end; i++)
+					histogram[(items[i].code >> shift) & (bucket_count - 1)]++;
+			});
+
+			// Digit-major, chunk-minor prefix sum keeps equal digits in their input order.
+			size_t offset = 0;
+			for (size_t digit = 0; digit < bucket_count; digit++)
+			{
+				for (size_t chunk = 0; chunk < chunk_count; chunk++)
+				{
+					const size_t n = offsets[chunk * bucket_count + digit];
+					offsets[chunk * bucket_count + digit] = offset;
+					offset += n;
+				}
+			}
+
+			parallel_for_chunks(count, grain, [&](size_t chunk, size_t begin, size_t chunk_end)
+			{
+				size_t* next = &offsets[chunk * bucket_count];
+				for (size_t i = begin; i < chunk_end; i++)
+					scratch[next[(items[i].code >> shift) & (bucket_count - 1)]++] = items[i];
+			});
+
+			items.swap(scratch);
+		}
+	}
+
+	/// <summary>
+	/// Interior node i of the radix tree over the sorted codes: finds the range of leaves it covers
+	/// and where that range splits, from the lengths of common code prefixes alone. Duplicate codes
+	/// are told apart by their position.
+	/// </summary>
+	static lbvh_node lbvh_interior_node(const std::vector<morton_primitive>& sorted, int64_t i, int code_bits)
+	{
+		const auto n = static_cast<int64_t>(sorted.size());
+		auto prefix = [&](int64_t a, int64_t b) -> int
+		{
+			if (b < 0 || b >= n) return -1;
+			if (sorted[a].code == sorted[b].code) return 64 + count_leading_zeros(static_cast<uint64_t>(a ^ b));
+			return count_leading_zeros(sorted[a].code ^ sorted[b].code);
+		};
+
+		// The range extends towards the neighbour sharing the longer prefix.
+		const int d = prefix(i, i + 1) > prefix(i, i - 1) ? 1 : -1;
+		const int prefix_min = prefix(i, i - d);
+
+		int64_t length_max = 2;
+		while (prefix(i, i + length_max * d) > prefix_min) length_max *= 2;
+		int64_t length = 0;
+		for (int64_t step = length_max / 2; step >= 1; step /= 2)
+			if (prefix(i, i + (length + step) * d) > prefix_min) length += step;
+		const int64_t j = i + length * d;
+
+		// Binary search for the last leaf sharing more than the node's prefix with leaf i.
+		const int node_prefix = prefix(i, j);
+		int64_t split = 0;
+		for (int64_t divisor = 2;; divisor *= 2)
+		{
+			const int64_t step = (length + divisor - 1) / divisor;
+			if (prefix(i, i + (split + step) * d) > node_prefix) split += step;
+			if (step <= 1) break;
+		}
+		const int64_t gamma = i + split * d + (d < 0 ? -1 : 0);
+
+		lbvh_node node;
+		node.child[0] = static_cast<uint32_t>(gamma);
+		node.child[1] = static_cast<uint32_t>(gamma + 1);
+		node.child_is_leaf[0] = (i < j ? i : j) == gamma;
+		node.child_is_leaf[1] = (i > j ? i : j) == gamma + 1;
+
+		// The first differing bit after the prefix is the split plane; codes interleave x, y, z
+		// from the top bit down. Splits between duplicate codes have no axis.
+		const int split_bit = 63 - node_prefix;
+		node.axis = split_bit >= 0 && split_bit < code_bits ? 2 - split_bit % 3 : 0;
+		node.first_leaf = static_cast<uint32_t>(i < j ? i : j);
+		node.leaf_count = 0;
+		return node;
+	}
+
+	/// <summary>
+	/// Bottom-up pass over the index-based tree: fills in boxes and leaf counts and, if enabled,
+	/// restructures the treelet rooted at every node once its children are final.
+	/// </summary>
+	static void finish_lbvh_subtree(lbvh_tree& tree, uint32_t index, build_context& context)
+	{
+		lbvh_node& node = tree.nodes[index];
+		auto finish_child = [&](int c)
+		{
+			if (!node.child_is_leaf[c]) finish_lbvh_subtree(tree, node.child[c], context);
+		};
+
+		// Treelets only reshape nodes below their root, so this node still has the radix tree's
+		// children here and its left child's leaves end where the right child's index starts.
+		const size_t left_leaves = node.child[1] - node.first_leaf;
+		context.fork_join(
+			left_leaves >= tree.options->parallel_subtree_threshold,
+			[&]() { finish_child(0); },
+			[&]() { finish_child(1); }
+		);
+
+		node.bbox = aabb(tree.box(node.child[0], node.child_is_leaf[0]), tree.box(node.child[1], node.child_is_leaf[1]));
+		node.leaf_count = tree.leaf_count(node.child[0], node.child_is_leaf[0])
+			+ tree.leaf_count(node.child[1], node.child_is_leaf[1]);
+
+		const int treelet_size = tree.options->treelet_size > 8 ? 8 : tree.options->treelet_size;
+		if (treelet_size >= 3) optimize_treelet(tree, index, treelet_size);
+	}
+
+	/// <summary>
+	/// Treelet restructuring (Karras and Aila 2013): grows a treelet of up to `size` leaves under
+	/// `root` by repeatedly opening its largest leaf, finds the binary tree over those leaves with
+	/// the lowest total interior surface area by dynamic programming over leaf subsets, and
+	/// rewires the treelet's interior nodes into that shape.
+	/// </summary>
+	static void optimize_treelet(lbvh_tree& tree, uint32_t root, int size)
+	{
+		lbvh_reference leaves[8];
+		uint32_t interiors[8];
+		int leaf_count = 0;
+		int interior_count = 0;
+
+		interiors[interior_count++] = root;
+		for (int c = 0; c < 2; c++) leaves[leaf_count++] = {tree.nodes[root].child[c], tree.nodes[root].child_is_leaf[c]};
+
+		while (leaf_count < size)
+		{
+			int best = -1;
+			double best_area = -1;
+			for (int k = 0; k < leaf_count; k++)
+			{
+				if (leaves[k].is_leaf) continue;
+				const double area = tree.nodes[leaves[k].index].bbox.surface_area();
+				if (area > best_area)
+				{
+					best_area = area;
+					best = k;
+				}
+			}
+			if (best < 0) break;
+
+			const lbvh_node& opened = tree.nodes[leaves[best].index];
+			interiors[interior_count++] = leaves[best].index;
+			leaves[best] = {opened.child[0], opened.child_is_leaf[0]};
+			leaves[leaf_count++] = {opened.child[1], opened.child_is_leaf[1]};
+		}
+		if (leaf_count < 3) return;
+
+		// Subsets of the treelet leaves as bit masks: union box, best cost, and best split.
+		const int subset_count = 1 << leaf_count;
+		aabb boxes[256];
+		double costs[256];
+		int splits[256];
+
+		for (int mask = 1; mask < subset_count; mask++)
+		{
+			const int low_bit = mask & -mask;
+			if (mask == low_bit)
+			{
+				int k = 0;
+				while ((1 << k) != mask) k++;
+				boxes[mask] = tree.box(leaves[k].index, leaves[k].is_leaf);
+				costs[mask] = 0;
+				continue;
+			}
+
+			boxes[mask] = aabb(boxes[low_bit], boxes[mask ^ low_bit]);
+
+			// Each split is visited once by keeping the lowest leaf on the left side.
+			double best = infinity;
+			int best_split = low_bit;
+			for (int sub = (mask - 1) & mask; sub != 0; sub = (sub - 1) & mask)
+			{
+				if ((sub & low_bit) == 0) continue;
+				const double cost = costs[sub] + costs[mask ^ sub];
+				if (cost < best)
+				{
+					best = cost;
+					best_split = sub;
+				}
+			}
+			costs[mask] = boxes[mask].surface_area() + best;
+			splits[mask] = best_split;
+		}
+
+		int next_interior = 0;
+		place_treelet_subset(tree, subset_count - 1, leaves, interiors, next_interior, boxes, splits);
+	}
+
+	static lbvh_reference place_treelet_subset(
+		lbvh_tree& tree, int mask, const lbvh_reference* leaves, const uint32_t* interiors, int& next_interior,
+		const aabb* boxes, const int* splits
+	)
+	{
+		if ((mask & (mask - 1)) == 0)
+		{
+			int k = 0;
+			while ((1 << k) != mask) k++;
+			return leaves[k];
+		}
+
+		// The treelet root is taken first, so it stays where its parent points.
+		const uint32_t index = interiors[next_interior++];
+		lbvh_reference children[2] = {
+			place_treelet_subset(tree, splits[mask], leaves, interiors, next_interior, boxes, splits),
+			place_treelet_subset(tree, mask ^ splits[mask], leaves, interiors, next_interior, boxes, splits)
+		};
+
+		// Order the children along the axis that separates their centers most, lower one first.
+		lbvh_node& node = tree.nodes[index];
+		const vec3 offset = boxes[mask ^ splits[mask]].centroid() - boxes[splits[mask]].centroid();
+		node.axis = 0;
+		for (int a = 1; a < 3; a++)
+			if (std::fabs(offset[a]) > std::fabs(offset[node.axis])) node.axis = a;
+		if (offset[node.axis] < 0) std::swap(children[0], children[1]);
+
+		for (int c = 0; c < 2; c++)
+		{
+			node.child[c] = children[c].index;
+			node.child_is_leaf[c] = children[c].is_leaf;
+		}
+		node.bbox = boxes[mask];
+		node.leaf_count = tree.leaf_count(children[0].index, children[0].is_leaf)
+			+ tree.leaf_count(children[1].index, children[1].is_leaf);
+		return {index, false};
+	}
+
+	void emit_lbvh(
+		const lbvh_tree& tree, uint32_t index, std::vector<shared_ptr<hittable>>& objects, size_t start,
+		build_context& context
+	)
+	{
+		const lbvh_node& node = tree.nodes[index];
+		bbox = node.bbox;
+		axis = node.axis;
+
+		shared_ptr<hittable> children[2];
+		shared_ptr<bvh_node> child_nodes[2];
+		for (int c = 0; c < 2; c++)
+		{
+			if (node.child_is_leaf[c])
+				children[c] = objects[start + node.child[c]];
+			else
+				children[c] = child_nodes[c] = make_shared<bvh_node>(build_tag());
+		}
+
+		auto emit_child = [&](int c)
+		{
+			if (child_nodes[c]) child_nodes[c]->emit_lbvh(tree, node.child[c], objects, start, context);
+		};
+		context.fork_join(
+			tree.leaf_count(node.child[0], node.child_is_leaf[0]) >= tree.options->parallel_subtree_threshold,
+			[&]() { emit_child(0); },
+			[&]() { emit_child(1); }
+		);
+
+		left = children[0];
+		right = children[1];
+	}
 
 	static bool box_compare(
 		const shared_ptr<hittable> a, const shared_ptr<hittable> b, int axis_index
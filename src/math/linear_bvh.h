@@ -0,0 +1,266 @@
+#pragma once
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "bvh.h"
+
+
+/// <summary>
+/// One node of a linear_bvh. Interior nodes store their first child immediately after
+/// themselves (depth-first order) and the index of the second child; leaves store a range into
+/// the primitive array. Bounds are single precision, rounded outwards, so a node fits in 32 bytes.
+/// </summary>
+struct alignas(32) linear_bvh_node
+{
+	float bounds_min[3];
+	float bounds_max[3];
+
+	union
+	{
+		int32_t primitives_offset; // Leaf
+		int32_t second_child_offset; // Interior
+	};
+
+	uint16_t primitive_count; // 0 for interior nodes
+	uint8_t axis; // Interior node split axis
+	uint8_t pad;
+
+	void set_bounds(const aabb& box)
+	{
+		for (int axis_index = 0; axis_index < 3; axis_index++)
+		{
+			const interval& ax = box.axis_interval(axis_index);
+			bounds_min[axis_index] = float_round_down(ax.min_);
+			bounds_max[axis_index] = float_round_up(ax.max_);
+		}
+	}
+
+	bool hit(const point3& origin, const vec3& inv_dir, const int dir_is_neg[3], const interval& ray_t) const
+	{
+		// Slab test with the near/far planes chosen up front from the ray direction sign, so no
+		// per-axis swap is needed.
+		double t_min = ray_t.min_;
+		double t_max = ray_t.max_;
+
+		for (int axis_index = 0; axis_index < 3; axis_index++)
+		{
+			const double near_plane = dir_is_neg[axis_index] ? bounds_max[axis_index] : bounds_min[axis_index];
+			const double far_plane = dir_is_neg[axis_index] ? bounds_min[axis_index] : bounds_max[axis_index];
+
+			const double t0 = (near_plane - origin[axis_index]) * inv_dir[axis_index];
+			const double t1 = (far_plane - origin[axis_index]) * inv_dir[axis_index];
+
+			if (t0 > t_min) t_min = t0;
+			if (t1 < t_max) t_max = t1;
+		}
+
+		return t_min < t_max;
+	}
+};
+
+static_assert(sizeof(linear_bvh_node) == 32, "linear_bvh_node should be 32 bytes");
+
+
+/// <summary>
+/// Pointer-free BVH compiled from a bvh_node tree. Nodes live in one contiguous array in
+/// depth-first order and are traversed with an explicit stack instead of recursive virtual calls.
+/// </summary>
+class linear_bvh : public hittable
+{
+public:
+	linear_bvh(hittable_list list, const bvh_build_options& options = {})
+		: linear_bvh(bvh_node(list, options))
+	{
+	}
+
+	explicit linear_bvh(const bvh_node& root)
+	{
+		bbox_ = root.bounding_box();
+		flatten_bvh_node(root, 0);
+	}
+
+	bool hit(const ray& r, const interval ray_t, hit_record& rec) const override
+	{
+		if (stack_depth_ <= max_stack_depth)
+		{
+			int to_visit[max_stack_depth];
+			return hit(r, ray_t, rec, to_visit);
+		}
+		std::vector<int> to_visit(stack_depth_);
+		return hit(r, ray_t, rec, to_visit.data());
+	}
+
+	bool occluded(const ray& r, const interval ray_t) const override
+	{
+		if (stack_depth_ <= max_stack_depth)
+		{
+			int to_visit[max_stack_depth];
+			return occluded(r, ray_t, to_visit);
+		}
+		std::vector<int> to_visit(stack_depth_);
+		return occluded(r, ray_t, to_visit.data());
+	}
+
+	aabb bounding_box() const override { return bbox_; }
+
+	size_t node_count() const { return nodes_.size(); }
+
+private:
+	// A traversal holds at most one pending far child per interior node on the current path, so
+	// stack_depth_ entries always suffice. Trees up to max_stack_depth deep, which is every
+	// reasonable tree, use a stack array; degenerate deeper ones (the SAH with one object per
+	// leaf over exponentially spaced objects, say) get a heap stack instead of overflowing.
+	static constexpr int max_stack_depth = 64;
+
+	// Lists up to this size are expanded into a leaf instead of being kept as one primitive.
+	static constexpr size_t max_leaf_primitives = 16;
+
+	std::vector<linear_bvh_node> nodes_;
+	std::vector<shared_ptr<hittable>> primitives_;
+	aabb bbox_;
+	int stack_depth_ = 0; // Most interior nodes on any root-to-leaf path
+
+	bool hit(const ray& r, interval ray_t, hit_record& rec, int* const to_visit) const
+	{
+		const point3& origin = r.origin();
+		const vec3& inv_dir = r.inv_direction();
+		const int dir_is_neg[3] = {r.sign(0), r.sign(1), r.sign(2)};
+
+		int to_visit_offset = 0;
+		int current = 0;
+		bool hit_anything = false;
+
+		while (true)
+		{
+			const linear_bvh_node& node = nodes_[current];
+			if (node.hit(origin, inv_dir, dir_is_neg, ray_t))
+			{
+				if (node.primitive_count > 0)
+				{
+					for (int i = 0; i < node.primitive_count; i++)
+					{
+						if (primitives_[node.primitives_offset + i]->hit(r, ray_t, rec))
+						{
+							hit_anything = true;
+							ray_t.max_ = rec.t;
+						}
+					}
+					if (to_visit_offset == 0) break;
+					current = to_visit[--to_visit_offset];
+				}
+				else if (dir_is_neg[node.axis])
+				{
+					to_visit[to_visit_offset++] = current + 1;
+					current = node.second_child_offset;
+				}
+				else
+				{
+					to_visit[to_visit_offset++] = node.second_child_offset;
+					current = current + 1;
+				}
+			}
+			else
+			{
+				if (to_visit_offset == 0) break;
+				current = to_visit[--to_visit_offset];
+			}
+		}
+
+		return hit_anything;
+	}
+
+	bool occluded(const ray& r, const interval ray_t, int* const to_visit) const
+	{
+		const point3& origin = r.origin();
+		const vec3& inv_dir = r.inv_direction();
+		const int dir_is_neg[3] = {r.sign(0), r.sign(1), r.sign(2)};
+
+		int to_visit_offset = 0;
+		int current = 0;
+
+		// Same walk as hit(), returning at the first primitive that blocks the ray.
+		while (true)
+		{
+			const linear_bvh_node& node = nodes_[current];
+			if (node.hit(origin, inv_dir, dir_is_neg, ray_t))
+			{
+				if (node.primitive_count > 0)
+				{
+					for (int i = 0; i < node.primitive_count; i++)
+						if (primitives_[node.primitives_offset + i]->occluded(r, ray_t)) return true;
+					if (to_visit_offset == 0) break;
+					current = to_visit[--to_visit_offset];
+				}
+				else if (dir_is_neg[node.axis])
+				{
+					to_visit[to_visit_offset++] = current + 1;
+					current = node.second_child_offset;
+				}
+				else
+				{
+					to_visit[to_visit_offset++] = node.second_child_offset;
+					current = current + 1;
+				}
+			}
+			else
+			{
+				if (to_visit_offset == 0) break;
+				current = to_visit[--to_visit_offset];
+			}
+		}
+
+		return false;
+	}
+
+	// `depth` counts the interior nodes above this one.
+	int flatten_bvh_node(const bvh_node& node, const int depth)
+	{
+		// A bvh_node with one child (a single object, or a leaf list chosen by the SAH) adds
+		// nothing to the hierarchy; its box is the child's box.
+		if (node.left == node.right) return flatten(node.left, node.bbox, depth);
+
+		stack_depth_ = depth + 1 > stack_depth_ ? depth + 1 : stack_depth_;
+
+		const int offset = static_cast<int>(nodes_.size());
+		nodes_.emplace_back();
+		nodes_[offset].set_bounds(node.bbox);
+		nodes_[offset].primitive_count = 0;
+
+		nodes_[offset].axis = static_cast<uint8_t>(node.axis);
+
+		// The left child lies on the low side of the split axis, so it goes first in the array.
+		flatten(node.left, node.left->bounding_box(), depth + 1);
+		nodes_[offset].second_child_offset = flatten(node.right, node.right->bounding_box(), depth + 1);
+
+		return offset;
+	}
+
+	int flatten(const shared_ptr<hittable>& object, const aabb& box, const int depth)
+	{
+		if (const auto* child = dynamic_cast<const bvh_node*>(object.get()))
+			return flatten_bvh_node(*child, depth);
+
+		const int offset = static_cast<int>(nodes_.size());
+		nodes_.emplace_back();
+		nodes_[offset].set_bounds(box);
+		nodes_[offset].axis = 0;
+		nodes_[offset].primitives_offset = static_cast<int32_t>(primitives_.size());
+
+		// Small lists (SAH leaves, box() sides) are expanded into the leaf so their members are
+		// tested directly instead of through another virtual hit.
+		const auto* list = dynamic_cast<const hittable_list*>(object.get());
+		if (list != nullptr && !list->objects.empty() && list->objects.size() <= max_leaf_primitives)
+		{
+			for (const auto& member : list->objects) primitives_.push_back(member);
+			nodes_[offset].primitive_count = static_cast<uint16_t>(list->objects.size());
+		}
+		else
+		{
+			primitives_.push_back(object);
+			nodes_[offset].primitive_count = 1;
+		}
+
+		return offset;
+	}
+};
@@ -0,0 +1,169 @@
+#pragma once
+#include <cmath>
+
+#include "aabb.h"
+#include "vec3.h"
+
+
+/// <summary>
+/// 4x4 affine matrix: a 3x3 linear part plus a translation column, with the bottom row fixed at
+/// (0, 0, 0, 1). Points pick up the translation, directions do not.
+/// </summary>
+class mat4
+{
+public:
+	double m[4][4];
+
+	mat4() : m{{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}, {0, 0, 0, 1}}
+	{
+	}
+
+	static mat4 identity() { return {}; }
+
+	static mat4 translation(const vec3& offset)
+	{
+		mat4 t;
+		for (int i = 0; i < 3; i++) t.m[i][3] = offset[i];
+		return t;
+	}
+
+	static mat4 scaling(const vec3& factors)
+	{
+		mat4 s;
+		for (int i = 0; i < 3; i++) s.m[i][i] = factors[i];
+		return s;
+	}
+
+	static mat4 rotation_y(const double angle)
+	{
+		// Same sense as rotate_y: +x turns towards -z.
+		const auto radians = degrees_to_radians(angle);
+		const double c = std::cos(radians);
+		const double s = std::sin(radians);
+
+		mat4 r;
+		r.m[0][0] = c;
+		r.m[0][2] = s;
+		r.m[2][0] = -s;
+		r.m[2][2] = c;
+		return r;
+	}
+
+	/// <summary>
+	/// Rotation by `angle` degrees about an arbitrary axis through the origin (Rodrigues).
+	/// </summary>
+	static mat4 rotation(const vec3& axis, const double angle)
+	{
+		const vec3 a = unit_vector(axis);
+		const auto radians = degrees_to_radians(angle);
+		const double c = std::cos(radians);
+		const double s = std::sin(radians);
+		const double t = 1 - c;
+
+		mat4 r;
+		r.m[0][0] = t * a.x() * a.x() + c;
+		r.m[0][1] = t * a.x() * a.y() - s * a.z();
+		r.m[0][2] = t * a.x() * a.z() + s * a.y();
+		r.m[1][0] = t * a.x() * a.y() + s * a.z();
+		r.m[1][1] = t * a.y() * a.y() + c;
+		r.m[1][2] = t * a.y() * a.z() - s * a.x();
+		r.m[2][0] = t * a.x() * a.z() - s * a.y();
+		r.m[2][1] = t * a.y() * a.z() + s * a.x();
+		r.m[2][2] = t * a.z() * a.z() + c;
+		return r;
+	}
+
+	point3 transform_point(const point3& p) const
+	{
+		return {
+			m[0][0] * p.x() + m[0][1] * p.y() + m[0][2] * p.z() + m[0][3],
+			m[1][0] * p.x() + m[1][1] * p.y() + m[1][2] * p.z() + m[1][3],
+			m[2][0] * p.x() + m[2][1] * p.y() + m[2][2] * p.z() + m[2][3]
+		};
+	}
+
+	vec3 transform_vector(const vec3& v) const
+	{
+		return {
+			m[0][0] * v.x() + m[0][1] * v.y() + m[0][2] * v.z(),
+			m[1][0] * v.x() + m[1][1] * v.y() + m[1][2] * v.z(),
+			m[2][0] * v.x() + m[2][1] * v.y() + m[2][2] * v.z()
+		};
+	}
+
+	// Transpose of the linear part, with no translation. The transposed inverse is the matrix
+	// that carries normals along with the surfaces this matrix moves.
+	mat4 transposed() const
+	{
+		mat4 t;
+		for (int i = 0; i < 3; i++)
+			for (int j = 0; j < 3; j++)
+				t.m[i][j] = m[j][i];
+		return t;
+	}
+
+	aabb transform_box(const aabb& box) const
+	{
+		// Each output axis of an affine map is smallest/largest at the box corners picked by the
+		// signs of that row, so it's enough to accumulate per coefficient (Arvo 1990).
+		interval axes[3];
+		for (int i = 0; i < 3; i++)
+		{
+			double lo = m[i][3];
+			double hi = m[i][3];
+			for (int j = 0; j < 3; j++)
+			{
+				if (m[i][j] == 0) continue; // 0 * inf would poison unbounded boxes
+				const double a = m[i][j] * box.axis_interval(j).min_;
+				const double b = m[i][j] * box.axis_interval(j).max_;
+				lo += a < b ? a : b;
+				hi += a < b ? b : a;
+			}
+			axes[i] = interval(lo, hi);
+		}
+		return {axes[0], axes[1], axes[2]};
+	}
+
+	double determinant() const
+	{
+		return m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1])
+			- m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
+			+ m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+	}
+
+	mat4 inverse() const
+	{
+		// Inverse of the linear part by cofactors, then the translation is undone by it.
+		const double inv_det = 1 / determinant();
+
+		mat4 r;
+		r.m[0][0] = (m[1][1] * m[2][2] - m[1][2] * m[2][1]) * inv_det;
+		r.m[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * inv_det;
+		r.m[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * inv_det;
+		r.m[1][0] = (m[1][2] * m[2][0] - m[1][0] * m[2][2]) * inv_det;
+		r.m[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * inv_det;
+		r.m[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * inv_det;
+		r.m[2][0] = (m[1][0] * m[2][1] - m[1][1] * m[2][0]) * inv_det;
+		r.m[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * inv_det;
+		r.m[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * inv_det;
+
+		const vec3 t = r.transform_vector(vec3(m[0][3], m[1][3], m[2][3]));
+		for (int i = 0; i < 3; i++) r.m[i][3] = -t[i];
+		return r;
+	}
+};
+
+
+inline mat4 operator*(const mat4& a, const mat4& b)
+{
+	mat4 r;
+	for (int i = 0; i < 3; i++)
+	{
+		for (int j = 0; j < 4; j++)
+		{
+			r.m[i][j] = a.m[i][0] * b.m[0][j] + a.m[i][1] * b.m[1][j] + a.m[i][2] * b.m[2][j];
+			if (j == 3) r.m[i][j] += a.m[i][3];
+		}
+	}
+	return r;
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include <cmath>
+
+#include "vec3.h"
+
+
+/// <summary>
+/// Orthonormal basis with w along a given direction, for sampling directions in a local frame
+/// (z up) and carrying them into world space.
+/// </summary>
+class onb
+{
+public:
+	explicit onb(const vec3& n)
+	{
+		axis_[2] = unit_vector(n);
+		const vec3 a = (std::fabs(axis_[2].x()) > 0.9) ? vec3(0, 1, 0) : vec3(1, 0, 0);
+		axis_[1] = unit_vector(cross(axis_[2], a));
+		axis_[0] = cross(axis_[2], axis_[1]);
+	}
+
+	const vec3& u() const { return axis_[0]; }
+	const vec3& v() const { return axis_[1]; }
+	const vec3& w() const { return axis_[2]; }
+
+	vec3 transform(const vec3& v) const
+	{
+		// Transform from basis coordinates to local space.
+		return (v[0] * axis_[0]) + (v[1] * axis_[1]) + (v[2] * axis_[2]);
+	}
+
+private:
+	vec3 axis_[3];
+};
@@ -133,24 +133,22 @@ inline vec3 unit_vector(const vec3& v)
 	return v / v.length();
 }
 
+// The two samplers below map two uniform numbers directly instead of rejecting points, so they
+// always use exactly two sample dimensions (see utils/sampler.h).
+
 inline vec3 random_in_unit_disk()
 {
-	while (true)
-	{
-		auto p = vec3(random_double(-1, 1), random_double(-1, 1), 0);
-		if (p.length_squared() < 1)
-			return p;
-	}
+	const auto r = std::sqrt(random_double());
+	const auto phi = 2 * pi * random_double();
+	return {r * std::cos(phi), r * std::sin(phi), 0};
 }
 
 inline vec3 random_unit_vector()
 {
-	while (true)
-	{
-		auto p = vec3::random(-1, 1);
-		const auto lens_q = p.length_squared();
-		if (1e-160 < lens_q && lens_q <= 1) return p / sqrt(lens_q); // ̫ӽ0ĵ
-	}
+	const auto z = 1 - 2 * random_double();
+	const auto r = std::sqrt(1 - z * z);
+	const auto phi = 2 * pi * random_double();
+	return {r * std::cos(phi), r * std::sin(phi), z};
 }
 
 
@@ -162,6 +160,21 @@ inline vec3 random_on_hemisphere(const vec3& normal)
 }
 
 
+// Direction in the z-up hemisphere with density cos(theta) / pi.
+inline vec3 random_cosine_direction()
+{
+	const auto r1 = random_double();
+	const auto r2 = random_double();
+
+	const auto phi = 2 * pi * r1;
+	const auto x = std::cos(phi) * std::sqrt(r2);
+	const auto y = std::sin(phi) * std::sqrt(r2);
+	const auto z = std::sqrt(1 - r2);
+
+	return {x, y, z};
+}
+
+
 inline vec3 reflect(const vec3& v, const vec3& n)
 {
 	return v - 2 * dot(v, n) * n;
@@ -0,0 +1,428 @@
+#pragma once
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#if defined(__AVX__) || defined(__AVX2__)
+#include <immintrin.h>
+#define RENDER_WIDE_BVH_AVX 1
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define RENDER_WIDE_BVH_SSE 1
+#endif
+
+#include "bvh.h"
+
+
+/// <summary>
+/// BVH with W = 4 or 8 children per node, collapsed from a binary bvh_node tree. Child boxes are
+/// stored as structure-of-arrays so one node's children are slab-tested together with SSE (W = 4)
+/// or AVX (W = 8), and hit children are visited nearest first.
+/// </summary>
+template <int W>
+class wide_bvh : public hittable
+{
+	static_assert(W == 4 || W == 8, "wide_bvh supports 4 or 8 children per node");
+
+public:
+	wide_bvh(hittable_list list, const bvh_build_options& options = {})
+		: wide_bvh(bvh_node(list, options))
+	{
+	}
+
+	explicit wide_bvh(const bvh_node& root)
+	{
+		bbox_ = root.bounding_box();
+
+		if (root.left == root.right)
+		{
+			// Degenerate single-leaf tree: give it a root node with one occupied slot.
+			nodes_.emplace_back();
+			set_child(0, 0, root.left, root.bbox);
+		}
+		else
+			collapse(root);
+
+		stack_entries_ = 1 + pending_entries();
+	}
+
+	bool hit(const ray& r, const interval ray_t, hit_record& rec) const override
+	{
+		if (stack_entries_ <= max_stack_entries)
+		{
+			stack_entry stack[max_stack_entries];
+			return hit(r, ray_t, rec, stack);
+		}
+		std::vector<stack_entry> stack(stack_entries_);
+		return hit(r, ray_t, rec, stack.data());
+	}
+
+	bool occluded(const ray& r, const interval ray_t) const override
+	{
+		if (stack_entries_ <= max_stack_entries)
+		{
+			stack_entry stack[max_stack_entries];
+			return occluded(r, ray_t, stack);
+		}
+		std::vector<stack_entry> stack(stack_entries_);
+		return occluded(r, ray_t, stack.data());
+	}
+
+	aabb bounding_box() const override { return bbox_; }
+
+	size_t node_count() const { return nodes_.size(); }
+
+private:
+	struct stack_entry;
+
+	bool hit(const ray& r, interval ray_t, hit_record& rec, stack_entry* const stack) const
+	{
+		const ray_data rd = make_ray_data(r);
+
+		int stack_size = 0;
+		stack[stack_size++] = {0, 0, static_cast<float>(ray_t.min_)};
+
+		bool hit_anything = false;
+
+		while (stack_size > 0)
+		{
+			const stack_entry entry = stack[--stack_size];
+
+			// Children are pushed with their box entry distance; anything entered beyond the
+			// closest hit so far cannot contain a closer one.
+			if (entry.t_near > ray_t.max_ * exit_scale) continue;
+
+			if (entry.count > 0)
+			{
+				for (int i = 0; i < entry.count; i++)
+				{
+					if (primitives_[entry.child + i]->hit(r, ray_t, rec))
+					{
+						hit_anything = true;
+						ray_t.max_ = rec.t;
+					}
+				}
+				continue;
+			}
+
+			const node& n = nodes_[entry.child];
+			alignas(32) float t_near[W];
+			int mask = intersect_children(n, rd, static_cast<float>(ray_t.min_), static_cast<float>(ray_t.max_), t_near);
+
+			// Push hit children far to near so the nearest one is popped first.
+			int order[W];
+			int hit_count = 0;
+			for (; mask != 0; mask &= mask - 1)
+			{
+				const int slot = lowest_bit(mask);
+				int k = hit_count++;
+				while (k > 0 && t_near[order[k - 1]] < t_near[slot])
+				{
+					order[k] = order[k - 1];
+					k--;
+				}
+				order[k] = slot;
+			}
+
+			for (int k = 0; k < hit_count; k++)
+			{
+				const int slot = order[k];
+				stack[stack_size++] = {n.child[slot], n.count[slot], t_near[slot]};
+			}
+		}
+
+		return hit_anything;
+	}
+
+	bool occluded(const ray& r, const interval ray_t, stack_entry* const stack) const
+	{
+		const ray_data rd = make_ray_data(r);
+
+		// Any hit ends the query, so children need no ordering or entry distances.
+		int stack_size = 0;
+		stack[stack_size++] = {0, 0, 0};
+
+		while (stack_size > 0)
+		{
+			const stack_entry entry = stack[--stack_size];
+
+			if (entry.count > 0)
+			{
+				for (int i = 0; i < entry.count; i++)
+					if (primitives_[entry.child + i]->occluded(r, ray_t)) return true;
+				continue;
+			}
+
+			const node& n = nodes_[entry.child];
+			alignas(32) float t_near[W];
+			int mask = intersect_children(n, rd, static_cast<float>(ray_t.min_), static_cast<float>(ray_t.max_), t_near);
+			for (; mask != 0; mask &= mask - 1)
+			{
+				const int slot = lowest_bit(mask);
+				stack[stack_size++] = {n.child[slot], n.count[slot], 0};
+			}
+		}
+
+		return false;
+	}
+
+	struct alignas(32) node
+	{
+		float lo[3][W]; // Child box minimum, per axis
+		float hi[3][W]; // Child box maximum, per axis
+		int32_t child[W]; // Node index for interior children, primitive offset for leaves
+		uint16_t count[W]; // Primitive count for leaf children, 0 for interior or empty slots
+
+		node()
+		{
+			// Empty slots get an inverted box, which no ray can enter.
+			for (int axis = 0; axis < 3; axis++)
+			{
+				for (int slot = 0; slot < W; slot++)
+				{
+					lo[axis][slot] = std::numeric_limits<float>::infinity();
+					hi[axis][slot] = -std::numeric_limits<float>::infinity();
+				}
+			}
+			for (int slot = 0; slot < W; slot++)
+			{
+				child[slot] = -1;
+				count[slot] = 0;
+			}
+		}
+	};
+
+	struct ray_data
+	{
+		float origin_near[3];
+		float origin_far[3];
+		float inv_dir[3];
+		int dir_is_neg[3];
+	};
+
+	struct stack_entry
+	{
+		int32_t child;
+		uint16_t count;
+		float t_near;
+	};
+
+	// Padding on exit distances covers the float rounding of the direction and the slab math.
+	static constexpr float exit_scale = 1.0f + 4 * std::numeric_limits<float>::epsilon();
+
+	// Traversal stacks up to this size live in a stack array. Visiting a node pops one entry and
+	// pushes up to one per occupied slot, so stack_entries_ (computed from the collapsed tree)
+	// always suffices; degenerate trees that need more get a heap stack.
+	static constexpr int max_stack_entries = 64 * W;
+
+	// Lists up to this size are expanded into a leaf instead of being kept as one primitive.
+	static constexpr size_t max_leaf_primitives = 16;
+
+	std::vector<node> nodes_;
+	std::vector<shared_ptr<hittable>> primitives_;
+	aabb bbox_;
+	int stack_entries_ = 1;
+
+	// Most entries a traversal can have pending below the root: over every root-to-leaf path,
+	// the sum of (occupied slots - 1) of its nodes. collapse() stores children after their
+	// parent, so one backward pass sees every child before its parent.
+	int pending_entries() const
+	{
+		std::vector<int> pending(nodes_.size(), 0);
+		for (size_t i = nodes_.size(); i-- > 0;)
+		{
+			int occupied = 0;
+			int deepest = 0;
+			for (int slot = 0; slot < W; slot++)
+			{
+				if (nodes_[i].child[slot] < 0) continue;
+				occupied++;
+				if (nodes_[i].count[slot] == 0 && pending[nodes_[i].child[slot]] > deepest)
+					deepest = pending[nodes_[i].child[slot]];
+			}
+			pending[i] = (occupied > 0 ? occupied - 1 : 0) + deepest;
+		}
+		return pending.empty() ? 0 : pending[0];
+	}
+
+	int collapse(const bvh_node& root)
+	{
+		// Pull grandchildren up into this node, always opening the child with the largest
+		// surface area (the one most likely to be entered), until W slots are used.
+		std::vector<shared_ptr<hittable>> children = {root.left, root.right};
+		while (children.size() < static_cast<size_t>(W))
+		{
+			int best = -1;
+			double best_area = -1;
+			for (size_t i = 0; i < children.size(); i++)
+			{
+				const auto* b = dynamic_cast<const bvh_node*>(children[i].get());
+				if (b == nullptr || b->left == b->right) continue;
+				const double area = b->bbox.surface_area();
+				if (area > best_area)
+				{
+					best_area = area;
+					best = static_cast<int>(i);
+				}
+			}
+			if (best < 0) break;
+
+			const auto* opened = static_cast<const bvh_node*>(children[best].get());
+			auto right = opened->right;
+			children[best] = opened->left;
+			children.push_back(right);
+		}
+
+		const int index = static_cast<int>(nodes_.size());
+		nodes_.emplace_back();
+
+		for (size_t slot = 0; slot < children.size(); slot++)
+			set_child(index, static_cast<int>(slot), children[slot], children[slot]->bounding_box());
+
+		return index;
+	}
+
+	void set_child(int index, int slot, const shared_ptr<hittable>& object, const aabb& box)
+	{
+		for (int axis = 0; axis < 3; axis++)
+		{
+			const interval& ax = box.axis_interval(axis);
+			nodes_[index].lo[axis][slot] = float_round_down(ax.min_);
+			nodes_[index].hi[axis][slot] = float_round_up(ax.max_);
+		}
+
+		if (const auto* b = dynamic_cast<const bvh_node*>(object.get()))
+		{
+			if (b->left != b->right)
+			{
+				const int child_index = collapse(*b);
+				nodes_[index].child[slot] = child_index;
+				nodes_[index].count[slot] = 0;
+				return;
+			}
+			set_child(index, slot, b->left, box);
+			return;
+		}
+
+		nodes_[index].child[slot] = static_cast<int32_t>(primitives_.size());
+
+		const auto* list = dynamic_cast<const hittable_list*>(object.get());
+		if (list != nullptr && !list->objects.empty() && list->objects.size() <= max_leaf_primitives)
+		{
+			for (const auto& member : list->objects) primitives_.push_back(member);
+			nodes_[index].count[slot] = static_cast<uint16_t>(list->objects.size());
+		}
+		else
+		{
+			primitives_.push_back(object);
+			nodes_[index].count[slot] = 1;
+		}
+	}
+
+	static ray_data make_ray_data(const ray& r)
+	{
+		ray_data rd;
+		for (int axis = 0; axis < 3; axis++)
+		{
+			rd.inv_dir[axis] = static_cast<float>(r.inv_direction()[axis]);
+			rd.dir_is_neg[axis] = r.sign(axis);
+
+			// Bracket the double-precision origin with the two nearest floats, using the one that
+			// makes each slab distance smaller for the near plane and larger for the far plane.
+			const float up = float_round_up(r.origin()[axis]);
+			const float down = float_round_down(r.origin()[axis]);
+			rd.origin_near[axis] = rd.dir_is_neg[axis] ? down : up;
+			rd.origin_far[axis] = rd.dir_is_neg[axis] ? up : down;
+		}
+		return rd;
+	}
+
+	static int intersect_children(const node& n, const ray_data& rd, float t_min, float t_max, float* t_near)
+	{
+#if defined(RENDER_WIDE_BVH_AVX)
+		if constexpr (W == 8)
+		{
+			__m256 t_enter = _mm256_set1_ps(t_min);
+			__m256 t_exit = _mm256_set1_ps(t_max);
+			for (int axis = 0; axis < 3; axis++)
+			{
+				const __m256 origin_near = _mm256_set1_ps(rd.origin_near[axis]);
+				const __m256 origin_far = _mm256_set1_ps(rd.origin_far[axis]);
+				const __m256 inv_dir = _mm256_set1_ps(rd.inv_dir[axis]);
+				const float* near_plane = rd.dir_is_neg[axis] ? n.hi[axis] : n.lo[axis];
+				const float* far_plane = rd.dir_is_neg[axis] ? n.lo[axis] : n.hi[axis];
+				const __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(near_plane), origin_near), inv_dir);
+				const __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(far_plane), origin_far), inv_dir);
+				// A NaN slab distance (0 * inf) leaves the running bound unchanged: max/min
+				// return their second operand when either input is NaN.
+				t_enter = _mm256_max_ps(t0, t_enter);
+				t_exit = _mm256_min_ps(t1, t_exit);
+			}
+			t_exit = _mm256_mul_ps(t_exit, _mm256_set1_ps(exit_scale));
+			_mm256_store_ps(t_near, t_enter);
+			return _mm256_movemask_ps(_mm256_cmp_ps(t_enter, t_exit, _CMP_LE_OQ));
+		}
+#endif
+
+#if defined(RENDER_WIDE_BVH_SSE)
+		if constexpr (W == 4)
+		{
+			__m128 t_enter = _mm_set1_ps(t_min);
+			__m128 t_exit = _mm_set1_ps(t_max);
+			for (int axis = 0; axis < 3; axis++)
+			{
+				const __m128 origin_near = _mm_set1_ps(rd.origin_near[axis]);
+				const __m128 origin_far = _mm_set1_ps(rd.origin_far[axis]);
+				const __m128 inv_dir = _mm_set1_ps(rd.inv_dir[axis]);
+				const float* near_plane = rd.dir_is_neg[axis] ? n.hi[axis] : n.lo[axis];
+				const float* far_plane = rd.dir_is_neg[axis] ? n.lo[axis] : n.hi[axis];
+				const __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(near_plane), origin_near), inv_dir);
+				const __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(far_plane), origin_far), inv_dir);
+				t_enter = _mm_max_ps(t0, t_enter);
+				t_exit = _mm_min_ps(t1, t_exit);
+			}
+			t_exit = _mm_mul_ps(t_exit, _mm_set1_ps(exit_scale));
+			_mm_store_ps(t_near, t_enter);
+			return _mm_movemask_ps(_mm_cmple_ps(t_enter, t_exit));
+		}
+#endif
+
+		// Portable fallback, written so the compiler can vectorize it.
+		int mask = 0;
+		for (int slot = 0; slot < W; slot++)
+		{
+			float t_enter = t_min;
+			float t_exit = t_max;
+			for (int axis = 0; axis < 3; axis++)
+			{
+				const float near_plane = rd.dir_is_neg[axis] ? n.hi[axis][slot] : n.lo[axis][slot];
+				const float far_plane = rd.dir_is_neg[axis] ? n.lo[axis][slot] : n.hi[axis][slot];
+				const float t0 = (near_plane - rd.origin_near[axis]) * rd.inv_dir[axis];
+				const float t1 = (far_plane - rd.origin_far[axis]) * rd.inv_dir[axis];
+				t_enter = t0 > t_enter ? t0 : t_enter;
+				t_exit = t1 < t_exit ? t1 : t_exit;
+			}
+			t_near[slot] = t_enter;
+			if (t_enter <= t_exit * exit_scale) mask |= 1 << slot;
+		}
+		return mask;
+	}
+
+	static int lowest_bit(int mask)
+	{
+		int bit = 0;
+		while ((mask & 1) == 0)
+		{
+			mask >>= 1;
+			bit++;
+		}
+		return bit;
+	}
+};
+
+
+using bvh4 = wide_bvh<4>;
+using bvh8 = wide_bvh<8>;
@@ -1,7 +1,24 @@
 #pragma once
-#include <fstream>
-
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+
+#include "entity/light_list.h"
+#include "render/checkpoint.h"
+#include "render/framebuffer.h"
+#include "render/image_output.h"
+#include "render/tile_output.h"
+#include "render/tile_scheduler.h"
 #include "utils/ProjectUtil.h"
+#include "utils/parallel.h"
+
+
+enum class integrator_mode
+{
+	path, // Light is only found by bounces that happen to hit an emitter
+	next_event, // Diffuse bounces also sample camera::lights directly, with a shadow ray
+	mis // Both of the above, weighted against each other with the power heuristic
+};
 
 
 class camera
@@ -9,9 +26,49 @@ class camera
 public:
 	double aspect_ratio = 1.0; // Ratio of image width over height
 	int image_width = 100; // Rendered image width in pixel count
-	int samples_per_pixel = 10; // Count of random samples for each pixel
+	int samples_per_pixel = 10; // Count of random samples for each pixel (the cap, when adaptive)
 	int max_depth = 10; // Maximum number of ray bounces into scene
+	int russian_roulette_depth = 3; // Bounces before Russian roulette may end a path (negative: never)
 	color background = color(0.70, 0.80, 1.00); // Scene background color
+	integrator_mode integrator = integrator_mode::path;
+	light_list lights; // Emitters sampled by the next_event integrator
+	sampler_type sampling = sampler_type::independent; // Source of every random number of a sample
+	uint32_t seed = 0; // Frame seed: the same seed renders the same image, on any number of threads
+	int tile_size = 16; // Threads render square tiles of this many pixels per side
+	tile_order tile_traversal = tile_order::hilbert; // Order of the tiles, and of each thread's share
+
+	// Adaptive and progressive rendering sample pixels in passes of this many samples, the last
+	// one cut to what samples_per_pixel leaves.
+	int pass_samples = 16;
+
+	// Adaptive sampling: every pixel gets adaptive_min_samples, then further passes until the
+	// relative error of its (gamma corrected) luminance drops to adaptive_threshold.
+	bool adaptive_sampling = false;
+	int adaptive_min_samples = 16;
+	double adaptive_threshold = 0.02;
+	bool write_sample_counts = false; // Also write the samples taken per pixel as a grayscale image
+	image_format output_format = image_format::ppm;
+
+	// One-shot renders can write each tile into a binary PPM as soon as it is finished (see
+	// tile_stream), so a crash keeps the tiles done so far. With output_format ppm that file is
+	// the output and the full-size film is never allocated.
+	bool stream_tiles = false;
+	bool stream_memory_mapped = true; // Through a memory map, where the system allows it
+
+	// Progressive rendering, on when either is set: whole passes over the image, rewriting the
+	// output after each, until the next pass would overrun the time budget or the image's mean
+	// relative error reaches target_error. samples_per_pixel still caps it.
+	double time_budget_seconds = 0;
+	double target_error = 0;
+
+	// Checkpointing, on when checkpoint_file is set: the accumulated film is saved there every
+	// checkpoint_interval_seconds and when the render ends, and a render that finds a checkpoint
+	// of the same image and sampling settings resumes it, adding samples up to samples_per_pixel
+	// (see continues() for which settings must match). Pixels are then sampled in passes, as for
+	// adaptive sampling. A top-up takes the samples a direct render of the new count would, except
+	// with independent sampling when the earlier count was not a whole number of passes.
+	std::string checkpoint_file;
+	double checkpoint_interval_seconds = 300;
 
 
 	double vfov = 90; // Vertical view angle (field of view)
@@ -23,85 +80,150 @@ public:
 	double defocus_angle = 0; // Variation angle of rays through each pixel
 	double focus_dist = 10; // Distance from camera lookfrom point to plane of perfect focus
 
+	struct tile_stats
+	{
+		image_tile tile;
+		double seconds = 0; // Render time, summed over passes
+		long long path_segments = 0;
+		long long samples = 0;
+	};
+
+	struct render_stats
+	{
+		long long camera_samples = 0;
+		long long path_segments = 0; // Rays traced against the world, camera rays included
+		long long tile_steals = 0; // Tiles a thread took from another thread's share
+		std::vector<tile_stats> tiles; // In traversal order
+
+		double mean_path_length() const
+		{
+			return camera_samples > 0 ? static_cast<double>(path_segments) / camera_samples : 0;
+		}
+	};
+
+	const render_stats& stats() const { return stats_; }
+
 	void render(const hittable& world, const std::string& name)
 	{
 		initialize();
+		stats_ = render_stats();
+		for (const auto& tile : make_tiles(image_width, image_height, tile_size, tile_traversal))
+			stats_.tiles.push_back({tile});
 
-		// 帧缓冲：按行主序存储每个像素最终颜色
-		std::vector<color> framebuffer(image_width * image_height, color(0, 0, 0));
+		// 输出到文件
+		const std::string filename = get_project_root_dir() + "\\output_" + name + image_extension(output_format);
 
-		// 并行策略：按扫描行分块。块大小可调（cache 友好 + 减少竞争）。
-		const int hardware_threads = max(1u, std::thread::hardware_concurrency());
-		constexpr int block_lines = 4; // 每个任务处理的行数，可根据场景/CPU 调整
+		std::unique_ptr<tile_stream> stream;
+		if (stream_tiles && !progressive())
+		{
+			const std::string stream_filename = get_project_root_dir() + "\\output_" + name + ".ppm";
+			stream = std::make_unique<tile_stream>(stream_filename, image_width, image_height, stream_memory_mapped);
+			if (!stream->is_open())
+			{
+				std::cerr << "Could not stream tiles to " << stream_filename << "\n";
+				stream.reset();
+			}
+		}
+		const bool checkpointing = !checkpoint_file.empty();
+		const bool streamed_output = stream && output_format == image_format::ppm;
+		const bool keep_film = !streamed_output || write_sample_counts || checkpointing;
 
-		std::atomic<int> next_line{0};
-		std::atomic<int> lines_done{0};
+		// 帧缓冲：按行主序存储每个像素最终颜色
+		framebuffer film(keep_film ? image_width : 0, keep_film ? image_height : 0,
+		                 adaptive_sampling || progressive() || checkpointing);
 
-		auto worker = [&]()
+		const checkpoint_settings resume_settings = {seed, sampling, samples_per_pixel, pass_samples};
+		bool resumed = false;
+		bool save_checkpoints = checkpointing;
+		if (checkpointing)
 		{
-			while (true)
+			switch (load_checkpoint(checkpoint_file, film, resume_settings))
 			{
-				int start = next_line.fetch_add(block_lines);
-				if (start >= image_height) break;
-				int end = min(start + block_lines, image_height);
-				for (int j = start; j < end; ++j)
-				{
-					for (int i = 0; i < image_width; ++i)
-					{
-						color pixel_color(0, 0, 0);
-						// 分层采样
-						for (int s_j = 0; s_j < sqrt_spp; ++s_j)
-						{
-							for (int s_i = 0; s_i < sqrt_spp; ++s_i)
-							{
-								ray r = get_ray(i, j, s_i, s_j);
-								pixel_color += ray_color(r, max_depth, world);
-							}
-						}
-						framebuffer[j * image_width + i] = pixel_samples_scale * pixel_color;
-					}
-					lines_done.fetch_add(1);
-				}
+			case checkpoint_load::resumed:
+				resumed = true;
+				std::clog << "Resumed " << checkpoint_file << " at "
+					<< static_cast<double>(film.total_samples()) / (image_width * image_height) << " samples per pixel\n";
+				break;
+			case checkpoint_load::mismatched:
+				save_checkpoints = false; // Don't overwrite another render's progress
+				std::cerr << checkpoint_file << " is a checkpoint of another image or sampling; not using it\n";
+				break;
+			default:
+				break;
 			}
-		};
+		}
 
-		std::vector<std::thread> threads;
-		threads.reserve(hardware_threads);
-		for (int t = 0; t < hardware_threads; ++t)
+		checkpoint_timer timer(checkpoint_interval_seconds);
+		auto save_state = [&](const framebuffer& state)
 		{
-			threads.emplace_back(worker);
-		}
+			if (!save_checkpoint(checkpoint_file, state, resume_settings))
+				std::cerr << "Could not write checkpoint " << checkpoint_file << "\n";
+			timer.restart();
+		};
 
-		// 简单进度输出
-		while (lines_done.load() < image_height)
+		if (progressive())
 		{
-			std::clog << "\rScanlines remaining: " << (image_height - lines_done.load()) << ' ' << std::flush;
-			std::this_thread::sleep_for(std::chrono::milliseconds(250));  // 主线程每 250ms 才查询一次进度，把资源给工作线程
+			render_progressive(world, film, filename, [&]
+			{
+				if (save_checkpoints && timer.due()) save_state(film);
+			});
 		}
-
-		for (auto& th : threads) th.join();
-		std::clog << "\rScanlines remaining: 0            \n";
-
-		// 输出到文件
-		const std::string filename = get_project_root_dir() + "\\output_" + name + ".ppm";
-		std::ofstream out(filename);
-		out << "P3\n" << image_width << ' ' << image_height << "\n255\n";
-		for (int j = 0; j < image_height; ++j)
+		else
 		{
-			for (int i = 0; i < image_width; ++i)
+			// Merges share the lock; a checkpoint takes it alone, so it only sees whole tiles. It
+			// holds it just to copy the film into `snapshot` and writes the copy after releasing it.
+			std::shared_mutex film_mutex;
+			std::mutex checkpoint_mutex; // Held by the worker writing a checkpoint; guards snapshot
+			framebuffer snapshot(0, 0, false);
+			trace_tiles([&](const image_tile& tile, tile_buffer& local, long long& segments)
 			{
-				write_color(out, framebuffer[j * image_width + i]);
-			}
+				for (int j = tile.y0; j < tile.y1; ++j)
+					for (int i = tile.x0; i < tile.x1; ++i)
+						render_pixel(i, j, world, keep_film ? film.at(i, j) : pixel_estimate(), local.at(i, j), segments);
+			}, [&](const tile_buffer& local)
+			{
+				{
+					std::shared_lock<std::shared_mutex> lock(film_mutex);
+					if (keep_film) film.merge(local);
+					if (stream && resumed) stream->write_tile(local.tile(), film);
+					else if (stream) stream->write_tile(local);
+				}
+
+				if (save_checkpoints && timer.due())
+				{
+					std::unique_lock<std::mutex> saving(checkpoint_mutex, std::try_to_lock);
+					if (saving.owns_lock() && timer.due())
+					{
+						{
+							std::unique_lock<std::shared_mutex> lock(film_mutex);
+							snapshot = film;
+						}
+						save_state(snapshot);
+					}
+				}
+			}, true);
+			stream.reset(); // Flushes it
+			if (!streamed_output) save_image(film, filename);
 		}
 
+		if (save_checkpoints) save_state(film);
+
+		for (const auto& tile : stats_.tiles) stats_.camera_samples += tile.samples;
+		print_tile_summary();
+		std::clog << "Mean path length: " << stats_.mean_path_length() << "\n";
+		std::clog << "Mean samples per pixel: "
+			<< static_cast<double>(stats_.camera_samples) / (image_width * image_height) << "\n";
 		std::clog << "Done (multithread). Output: " << filename << "\n";
+
+		if (write_sample_counts)
+			write_sample_count_image(film, get_project_root_dir() + "\\output_" + name + "_samples.pgm");
 	}
 
 private:
 	int image_height = 0; // Rendered image height
-	double pixel_samples_scale = 0; // Color scale_ factor for a sum of pixel samples
-	int sqrt_spp; // Square root of number of samples per pixel
+	int sqrt_spp; // Strata per side in one pass over a pixel
 	double recip_sqrt_spp; // 1 / sqrt_spp
+	int max_samples = 0; // Per pixel
 	point3 center; // Camera center
 	point3 pixel00_loc; // Location of pixel 0, 0
 	vec3 pixel_delta_u; // Offset to pixel to the right
@@ -113,17 +235,27 @@ private:
 	vec3 u, v, w; // Camera frame basis vectors
 	vec3 defocus_disk_u; // Defocus disk horizontal radius
 	vec3 defocus_disk_v; // Defocus disk vertical radius
+	render_stats stats_; // Of the last render
+
+	bool progressive() const { return time_budget_seconds > 0 || target_error > 0; }
+
+	bool converged(const pixel_estimate& pixel) const
+	{
+		return adaptive_sampling && pixel.samples >= adaptive_min_samples
+			&& pixel.relative_error() <= adaptive_threshold;
+	}
 
 	void initialize()
 	{
 		image_height = static_cast<int>(image_width / aspect_ratio);
 		image_height = (image_height < 1) ? 1 : image_height;
 
-		sqrt_spp = static_cast<int>(std::sqrt(samples_per_pixel));
-		pixel_samples_scale = 1.0 / (sqrt_spp * sqrt_spp);
+		// A fixed budget is one stratified pass; otherwise the strata cover one pass.
+		const bool in_passes = adaptive_sampling || progressive() || !checkpoint_file.empty();
+		sqrt_spp = static_cast<int>(std::sqrt(in_passes ? pass_samples : samples_per_pixel));
+		sqrt_spp = (sqrt_spp < 1) ? 1 : sqrt_spp;
 		recip_sqrt_spp = 1.0 / sqrt_spp;
-
-		pixel_samples_scale = 1.0 / samples_per_pixel;
+		max_samples = in_passes ? samples_per_pixel : sqrt_spp * sqrt_spp;
 
 		center = lookfrom;
 
@@ -162,21 +294,321 @@ private:
 		defocus_disk_v = v * defocus_radius;
 	}
 
-	color ray_color(const ray& r, const int depth, const hittable& world)
+	/// <summary>
+	/// Calls body(tile, local, segments) for every tile of stats_.tiles on the worker threads,
+	/// through a work-stealing tile_scheduler. The body accumulates the tile's new samples into
+	/// `local`, the worker's tile_buffer, which is then handed to finish(local) on the same
+	/// thread; `segments` is the worker's counter of traced rays. Each tile's render time, ray
+	/// count and samples go to its stats.
+	/// </summary>
+	template <typename Body, typename Finish>
+	void trace_tiles(Body&& body, Finish&& finish, const bool show_progress)
+	{
+		const int thread_count = worker_thread_count();
+		const int tile_count = static_cast<int>(stats_.tiles.size());
+		tile_scheduler scheduler(stats_.tiles.size(), thread_count);
+
+		std::atomic<int> tiles_done{0};
+		std::atomic<long long> path_segments{0};
+
+		auto worker = [&](const int thread_index)
+		{
+			long long local_segments = 0;
+			tile_buffer local;
+			const auto thread_sampler = make_sampler();
+			sampler_scope scope(thread_sampler.get());
+
+			int tile_index;
+			while (scheduler.next(thread_index, tile_index))
+			{
+				tile_stats& tile = stats_.tiles[tile_index];
+				const long long segments_before = local_segments;
+				const auto start = std::chrono::steady_clock::now();
+
+				local.reset(tile.tile);
+				body(tile.tile, local, local_segments);
+				finish(local);
+
+				tile.seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+				tile.path_segments += local_segments - segments_before;
+				tile.samples += local.total_samples();
+				tiles_done.fetch_add(1);
+			}
+
+			path_segments.fetch_add(local_segments);
+		};
+
+		task_group group;
+		for (int t = 0; t < thread_count; ++t)
+		{
+			group.run([&worker, t] { worker(t); });
+		}
+
+		// 简单进度输出
+		// Wakes every 250 ms to report, and as soon as the last tile is done.
+		while (show_progress && !group.wait_for(std::chrono::milliseconds(250)))
+		{
+			std::clog << "\rTiles remaining: " << (tile_count - tiles_done.load()) << ' ' << std::flush;
+		}
+
+		group.wait();
+		if (show_progress) std::clog << "\rTiles remaining: 0            \n";
+
+		stats_.path_segments += path_segments.load();
+		stats_.tile_steals += scheduler.steals();
+	}
+
+	void print_tile_summary() const
+	{
+		if (stats_.tiles.empty()) return;
+
+		double fastest = infinity;
+		double slowest = 0;
+		double total = 0;
+		for (const auto& tile : stats_.tiles)
+		{
+			fastest = tile.seconds < fastest ? tile.seconds : fastest;
+			slowest = tile.seconds > slowest ? tile.seconds : slowest;
+			total += tile.seconds;
+		}
+
+		std::clog << "Tiles: " << stats_.tiles.size() << " of " << tile_size << "px, "
+			<< "ms per tile min " << 1000 * fastest
+			<< " / mean " << 1000 * total / static_cast<double>(stats_.tiles.size())
+			<< " / max " << 1000 * slowest
+			<< ", steals " << stats_.tile_steals << "\n";
+	}
+
+	// One stratified pass of sqrt_spp^2 samples over pixel (i, j), added to `pixel`, or `budget`
+	// samples if that is fewer. A pass cut short can't cover every stratum, so its samples spread
+	// over the whole pixel instead. The pixel already has `first_sample` samples elsewhere;
+	// sample indices continue from there.
+	void sample_pass(const int i, const int j, const hittable& world, const int first_sample, const int budget,
+	                 pixel_estimate& pixel, long long& segments) const
 	{
-		if (depth <= 0) return {0, 0, 0};
-		hit_record rec;
+		sampler* const pixel_sampler = active_sampler();
+		const bool whole_pass = budget >= sqrt_spp * sqrt_spp;
+		const int count = whole_pass ? sqrt_spp * sqrt_spp : budget;
+		for (int s = 0; s < count; ++s)
+		{
+			const auto sample_index = static_cast<uint32_t>(first_sample + pixel.samples);
+			seed_thread_rng(i, j, sample_index, seed);
+			if (pixel_sampler) pixel_sampler->start_sample(i, j, sample_index);
+			pixel.add(ray_color(whole_pass ? get_ray(i, j, s % sqrt_spp, s / sqrt_spp) : get_ray(i, j), world, segments));
+		}
+	}
+
+	std::unique_ptr<sampler> make_sampler() const
+	{
+		switch (sampling)
+		{
+		case sampler_type::sobol:
+			return std::make_unique<sobol_sampler>(seed);
+		case sampler_type::blue_noise:
+			return std::make_unique<blue_noise_sampler>(samples_per_pixel, image_width, image_height, seed);
+		default:
+			return nullptr; // random_double() keeps using the thread's generator
+		}
+	}
+
+	// Passes over pixel (i, j) until max_samples, or until it has converged, adding to the
+	// `previous` samples a resumed render already has.
+	void render_pixel(const int i, const int j, const hittable& world, const pixel_estimate& previous, pixel_estimate& pixel,
+	                  long long& segments) const
+	{
+		pixel_estimate total = previous;
+		while (total.samples < max_samples && !converged(total))
+		{
+			sample_pass(i, j, world, previous.samples, max_samples - total.samples, pixel, segments);
+			total = previous;
+			total.merge(pixel);
+		}
+	}
+
+	// after_pass() runs between passes, while no tile is being rendered.
+	template <typename AfterPass>
+	void render_progressive(const hittable& world, framebuffer& film, const std::string& filename, AfterPass&& after_pass)
+	{
+		using clock = std::chrono::steady_clock;
+		const auto start = clock::now();
+
+		for (int pass = 1;; pass++)
+		{
+			const auto pass_start = clock::now();
+			trace_tiles([&](const image_tile& tile, tile_buffer& local, long long& segments)
+			{
+				for (int j = tile.y0; j < tile.y1; ++j)
+				{
+					for (int i = tile.x0; i < tile.x1; ++i)
+					{
+						const pixel_estimate pixel = film.at(i, j);
+						if (pixel.samples < max_samples && !converged(pixel))
+							sample_pass(i, j, world, pixel.samples, max_samples - pixel.samples, local.at(i, j), segments);
+					}
+				}
+			}, [&](const tile_buffer& local) { film.merge(local); }, false);
+			save_image(film, filename);
+			after_pass();
+
+			double error = 0;
+			bool done = true; // Every pixel at the cap or converged
+			for (int j = 0; j < image_height; ++j)
+			{
+				for (int i = 0; i < image_width; ++i)
+				{
+					const pixel_estimate pixel = film.at(i, j);
+					error += pixel.relative_error();
+					done = done && (pixel.samples >= max_samples || converged(pixel));
+				}
+			}
+			error /= static_cast<double>(image_width) * image_height;
+
+			const auto now = clock::now();
+			const double elapsed = std::chrono::duration<double>(now - start).count();
+			const double pass_seconds = std::chrono::duration<double>(now - pass_start).count();
+			std::clog << "\rPass " << pass << ": error " << error << ", " << elapsed << " s   " << std::flush;
+
+			if (done) break;
+			if (target_error > 0 && error <= target_error) break;
+			// Passes take about equally long, so stop if the next one would not fit.
+			if (time_budget_seconds > 0 && elapsed + pass_seconds > time_budget_seconds) break;
+		}
+
+		std::clog << "\n";
+	}
+
+	void save_image(const framebuffer& film, const std::string& filename) const
+	{
+		if (!write_image(filename, film, output_format)) std::cerr << "Could not write " << filename << "\n";
+	}
+
+	void write_sample_count_image(const framebuffer& film, const std::string& filename) const
+	{
+		int most = 1;
+		for (int j = 0; j < image_height; ++j)
+			for (int i = 0; i < image_width; ++i) most = film.samples(i, j) > most ? film.samples(i, j) : most;
+
+		// Brightness is proportional to the samples taken, white being the busiest pixel.
+		std::vector<uint8_t> levels(static_cast<size_t>(image_width) * image_height);
+		for (int j = 0; j < image_height; ++j)
+			for (int i = 0; i < image_width; ++i)
+				levels[j * image_width + i] = static_cast<uint8_t>(255.0 * film.samples(i, j) / most);
+		write_pnm(filename, image_width, image_height, 1, levels);
+
+		std::clog << "Sample counts: " << filename << " (max " << most << ")\n";
+	}
+
+	/// <summary>
+	/// Iterative path tracer. Throughput (the product of attenuations so far) is carried forward
+	/// and emission is accumulated as it is found. After russian_roulette_depth bounces a path
+	/// survives with probability equal to its largest throughput channel, and survivors are
+	/// reweighted by 1/p, so dim paths stop early without biasing the estimate.
+	/// </summary>
+	color ray_color(const ray& r, const hittable& world, long long& segments) const
+	{
+		const bool sample_lights = integrator != integrator_mode::path && !lights.empty();
+
+		color radiance(0, 0, 0);
+		color throughput(1, 1, 1);
+		ray current = r;
+		double scatter_pdf = 0; // Density of the last bounce's direction; 0 if it sampled no light
+
+		for (int depth = 0; depth < max_depth; depth++)
+		{
+			hit_record rec;
+			segments++;
+
+			// If the ray hits nothing, add the background color.
+			if (!world.hit(current, interval(0.001, infinity), rec))
+			{
+				radiance += throughput * background;
+				break;
+			}
+
+			if (rec.mat->type == material_type::diffuse_light)
+			{
+				// If the previous bounce also sampled the lights and this emitter is one of them, it
+				// may already be part of that light sample; the two estimates share it by their
+				// weights. Emitters light sampling doesn't know are only found here.
+				double weight = 1;
+				if (scatter_pdf > 0 && rec.sampled_light)
+					weight = bounce_weight(scatter_pdf, lights.pdf_value(current.origin(), current.direction(), current.time()));
+				radiance += weight * throughput * rec.mat->emitted(rec.u, rec.v, rec.p);
+			}
+
+			ray scattered;
+			color attenuation;
+			if (!rec.mat->scatter(current, rec, attenuation, scattered)) break;
+
+			scatter_pdf = 0;
+			if (sample_lights && !rec.mat->is_specular())
+			{
+				radiance += throughput * sample_light(rec, current.time(), world);
+				scatter_pdf = rec.mat->pdf(rec, scattered.direction());
+			}
+
+			throughput = throughput * attenuation;
+
+			if (russian_roulette_depth >= 0 && depth >= russian_roulette_depth)
+			{
+				double survival = throughput.x() > throughput.y() ? throughput.x() : throughput.y();
+				survival = throughput.z() > survival ? throughput.z() : survival;
+				if (survival < 1)
+				{
+					if (random_double() >= survival) break;
+					throughput /= survival;
+				}
+			}
+
+			current = scattered;
+		}
+
+		return radiance;
+	}
+
+	static double power_heuristic(const double pdf, const double other_pdf)
+	{
+		const double a = pdf * pdf;
+		const double b = other_pdf * other_pdf;
+		return a / (a + b);
+	}
+
+	// Weight of emission found by a bounce (density scatter_pdf) that light sampling could also
+	// have produced (density light_pdf). Light sampling alone takes all of it when it can.
+	double bounce_weight(const double scatter_pdf, const double light_pdf) const
+	{
+		if (light_pdf <= 0) return 1;
+		if (integrator == integrator_mode::mis) return power_heuristic(scatter_pdf, light_pdf);
+		return 0;
+	}
+
+	/// <summary>
+	/// Next-event estimation: one point on one light, weighted by the pdf of having picked it,
+	/// and kept only if a shadow ray reaches it unblocked. Under mis the result is weighted
+	/// against the material's own sampling of the same direction.
+	/// </summary>
+	color sample_light(const hit_record& rec, const double time, const hittable& world) const
+	{
+		const hittable& light = lights.pick();
+		const vec3 direction = unit_vector(light.random(rec.p, time));
+
+		const color f = rec.mat->eval(rec, direction);
+		if (f.near_zero()) return {0, 0, 0};
+
+		const ray shadow(rec.p, direction, time);
+		hit_record light_rec;
+		if (!light.hit(shadow, interval(0.001, infinity), light_rec)) return {0, 0, 0};
+
+		const double pdf = light.pdf_value(rec.p, direction, time) * lights.pick_probability();
+		if (pdf <= 0) return {0, 0, 0};
 
-		// If the ray hits nothing, return the background color.
-		if (!world.hit(r, interval(0.001, infinity), rec)) return background;
+		if (world.occluded(shadow, interval(0.001, light_rec.t - 0.001))) return {0, 0, 0};
 
-		ray scattered;
-		color attenuation;
-		color color_from_emission = rec.mat->emitted(rec.u, rec.v, rec.p);
+		double weight = 1;
+		if (integrator == integrator_mode::mis)
+			weight = power_heuristic(lights.pdf_value(rec.p, direction, time), rec.mat->pdf(rec, direction));
 
-		if (!rec.mat->scatter(r, rec, attenuation, scattered)) return color_from_emission;
-		color color_from_scatter = attenuation * ray_color(scattered, depth - 1, world);
-		return color_from_emission + color_from_scatter;
+		return weight * f * light_rec.mat->emitted(light_rec.u, light_rec.v, light_rec.p) / pdf;
 	}
 
 	ray get_ray(const int i, const int j) const
@@ -206,7 +638,8 @@ private:
 		// Construct a camera ray originating from the defocus disk and directed at a randomly
 		// sampled point around the pixel location i, j for stratified sample square s_i, s_j.
 
-		auto offset = sample_square_stratified(s_i, s_j);
+		// A low-discrepancy sampler stratifies the pixel better than the jittered grid does.
+		auto offset = active_sampler() ? sample_square() : sample_square_stratified(s_i, s_j);
 		auto pixel_sample = pixel00_loc
 			+ ((i + offset.x()) * pixel_delta_u)
 			+ ((j + offset.y()) * pixel_delta_v);
@@ -0,0 +1,170 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+
+#include "render/framebuffer.h"
+#include "utils/sampler.h"
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+
+// Render checkpoints: a fixed header followed by the framebuffer's accumulation state. Sample
+// indices are the pixels' sample counts and every random number is derived from (pixel, sample
+// index, seed), so the counts and the sampling settings are all it takes to continue a render
+// exactly where it stopped. 16 bytes per pixel, 24 with variance.
+
+// What decides the samples a render takes, besides the image size.
+struct checkpoint_settings
+{
+	uint32_t seed;
+	sampler_type sampling;
+	int samples_per_pixel;
+	int pass_samples; // Strata of independent sampling
+};
+
+struct checkpoint_header
+{
+	char magic[8] = {'R', 'T', 'C', 'K', 'P', 'T', '0', '2'};
+	int32_t width = 0;
+	int32_t height = 0;
+	uint32_t seed = 0;
+	uint32_t sampling = 0; // sampler_type
+	uint32_t has_variance = 0;
+	int32_t samples_per_pixel = 0;
+	int32_t pass_samples = 0;
+	uint32_t reserved = 0;
+};
+
+enum class checkpoint_load
+{
+	missing, // No checkpoint, or not a readable one
+	resumed,
+	mismatched // A checkpoint of a different image size or sampling settings
+};
+
+// Whether a render with `settings` takes the same samples as the checkpointed one, so that it
+// can add to them. Another samples_per_pixel only changes where the render stops, except with
+// blue-noise sampling: there it sets how long each pixel's run of the shared sequence is, and
+// another run length would give one pixel's new samples the points of another pixel's old ones.
+inline bool continues(const checkpoint_header& header, const checkpoint_settings& settings)
+{
+	if (header.seed != settings.seed || header.sampling != static_cast<uint32_t>(settings.sampling)) return false;
+
+	switch (settings.sampling)
+	{
+	case sampler_type::independent:
+		return header.pass_samples == settings.pass_samples;
+	case sampler_type::blue_noise:
+		return blue_noise_sampler::run_log2(header.samples_per_pixel) == blue_noise_sampler::run_log2(settings.samples_per_pixel);
+	default:
+		return true;
+	}
+}
+
+
+// Forces a written and closed file's contents to stable storage.
+inline bool sync_to_disk(const std::string& path)
+{
+#ifdef _WIN32
+	const HANDLE file = CreateFileA(path.c_str(), GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE) return false;
+	const bool synced = FlushFileBuffers(file) != 0;
+	CloseHandle(file);
+	return synced;
+#else
+	const int descriptor = open(path.c_str(), O_WRONLY);
+	if (descriptor < 0) return false;
+	const bool synced = fsync(descriptor) == 0;
+	close(descriptor);
+	return synced;
+#endif
+}
+
+// Written to a temporary file that is synced to disk and only then replaces the old checkpoint,
+// so a crash while saving, even of the machine, keeps the previous one.
+inline bool save_checkpoint(const std::string& path, const framebuffer& film, const checkpoint_settings& settings)
+{
+	checkpoint_header header;
+	header.width = film.width();
+	header.height = film.height();
+	header.seed = settings.seed;
+	header.sampling = static_cast<uint32_t>(settings.sampling);
+	header.has_variance = film.tracks_variance() ? 1 : 0;
+	header.samples_per_pixel = settings.samples_per_pixel;
+	header.pass_samples = settings.pass_samples;
+
+	const std::string temporary = path + ".tmp";
+	{
+		std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+		out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		if (!out || !film.write_state(out)) return false;
+
+		// The destructor would drop a failure of the final flush.
+		out.close();
+		if (!out) return false;
+	}
+	if (!sync_to_disk(temporary)) return false;
+
+#ifdef _WIN32
+	return MoveFileExA(temporary.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+	return std::rename(temporary.c_str(), path.c_str()) == 0;
+#endif
+}
+
+// Replaces `film` with the checkpoint's state if the checkpoint matches it; leaves it alone
+// otherwise.
+inline checkpoint_load load_checkpoint(const std::string& path, framebuffer& film, const checkpoint_settings& settings)
+{
+	std::ifstream in(path, std::ios::binary);
+	checkpoint_header header;
+	const checkpoint_header expected;
+	if (!in.read(reinterpret_cast<char*>(&header), sizeof(header))) return checkpoint_load::missing;
+	if (std::memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0) return checkpoint_load::missing;
+
+	if (header.width != film.width() || header.height != film.height() || !continues(header, settings)
+		|| (header.has_variance != 0) != film.tracks_variance())
+		return checkpoint_load::mismatched;
+
+	framebuffer loaded(film.width(), film.height(), film.tracks_variance());
+	if (!loaded.read_state(in)) return checkpoint_load::missing;
+	film = std::move(loaded);
+	return checkpoint_load::resumed;
+}
+
+
+// When the next periodic checkpoint is due. Any thread may ask.
+class checkpoint_timer
+{
+public:
+	explicit checkpoint_timer(const double interval_seconds)
+		: start_(std::chrono::steady_clock::now()),
+		  interval_ms_(static_cast<long long>(1000 * interval_seconds)),
+		  next_ms_(interval_ms_)
+	{
+	}
+
+	bool due() const { return interval_ms_ > 0 && elapsed_ms() >= next_ms_.load(); }
+
+	void restart() { next_ms_.store(elapsed_ms() + interval_ms_); }
+
+private:
+	std::chrono::steady_clock::time_point start_;
+	long long interval_ms_;
+	std::atomic<long long> next_ms_;
+
+	long long elapsed_ms() const
+	{
+		return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start_).count();
+	}
+};
@@ -0,0 +1,229 @@
+#pragma once
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+#include "render/color.h"
+#include "render/tile_scheduler.h"
+
+
+/// <summary>
+/// Running estimate of one pixel in double precision: the color sum and sample count, plus the
+/// mean and squared deviations of the samples' luminance (Welford) for the variance.
+/// </summary>
+struct pixel_estimate
+{
+	color sum = color(0, 0, 0);
+	int samples = 0;
+	double mean = 0; // Of the samples' luminance
+	double m2 = 0; // Sum of squared deviations from that mean
+
+	void add(const color& sample)
+	{
+		sum += sample;
+		samples++;
+
+		const double y = luminance(sample);
+		const double delta = y - mean;
+		mean += delta / samples;
+		m2 += delta * (y - mean);
+	}
+
+	// Combines two estimates of the same pixel from disjoint samples (Chan et al.).
+	void merge(const pixel_estimate& other)
+	{
+		if (other.samples == 0) return;
+		if (samples == 0)
+		{
+			*this = other;
+			return;
+		}
+
+		const double n = static_cast<double>(samples) + other.samples;
+		const double delta = other.mean - mean;
+		mean += delta * other.samples / n;
+		m2 += other.m2 + delta * delta * samples * other.samples / n;
+		sum += other.sum;
+		samples += other.samples;
+	}
+
+	color estimate() const
+	{
+		return samples > 0 ? sum / samples : color(0, 0, 0);
+	}
+
+	// Standard error of the luminance mean, relative to the square root of the mean: roughly
+	// the relative error left after the gamma 2 output transform. The floor keeps black pixels
+	// from dividing by zero.
+	double relative_error() const
+	{
+		if (samples < 2) return infinity;
+		const double standard_error = std::sqrt(m2 / (samples - 1) / samples);
+		return standard_error / std::sqrt(mean > 0.0001 ? mean : 0.0001);
+	}
+};
+
+
+/// <summary>
+/// Scratch accumulation for the tile a worker is rendering. Each worker owns one and reuses it
+/// from tile to tile, so threads never write to each other's memory while tracing; the finished
+/// tile is then merged into the framebuffer.
+/// </summary>
+class tile_buffer
+{
+public:
+	void reset(const image_tile& tile)
+	{
+		tile_ = tile;
+		width_ = tile.x1 - tile.x0;
+		pixels_.assign(static_cast<size_t>(width_) * (tile.y1 - tile.y0), pixel_estimate());
+	}
+
+	const image_tile& tile() const { return tile_; }
+
+	long long total_samples() const
+	{
+		long long total = 0;
+		for (const auto& pixel : pixels_) total += pixel.samples;
+		return total;
+	}
+
+	// Pixel (x, y) of the image, which must lie in the tile.
+	pixel_estimate& at(const int x, const int y) { return pixels_[(y - tile_.y0) * width_ + (x - tile_.x0)]; }
+	const pixel_estimate& at(const int x, const int y) const { return pixels_[(y - tile_.y0) * width_ + (x - tile_.x0)]; }
+
+private:
+	image_tile tile_ = {0, 0, 0, 0};
+	int width_ = 0;
+	std::vector<pixel_estimate> pixels_;
+};
+
+
+/// <summary>
+/// The image being rendered, accumulated across tiles and passes. Stores float color sums and a
+/// sample count per pixel (16 bytes, against 48 for a pixel_estimate), and the luminance mean and
+/// squared deviations only when variance is tracked, for adaptive sampling and error reports.
+/// </summary>
+class framebuffer
+{
+public:
+	// One pixel as stored: 16 bytes, so four of them load as four SSE registers.
+	struct film_pixel
+	{
+		float sum[3] = {0, 0, 0};
+		uint32_t samples = 0;
+	};
+
+	framebuffer(const int width, const int height, const bool track_variance)
+		: width_(width), height_(height),
+		  pixels_(static_cast<size_t>(width) * height),
+		  variance_(track_variance ? static_cast<size_t>(width) * height : 0)
+	{
+	}
+
+	int width() const { return width_; }
+	int height() const { return height_; }
+	bool tracks_variance() const { return !variance_.empty(); }
+
+	// A pixel's color sum and sample count as the film stores them.
+	static film_pixel stored(const pixel_estimate& pixel)
+	{
+		film_pixel p;
+		p.sum[0] = static_cast<float>(pixel.sum.x());
+		p.sum[1] = static_cast<float>(pixel.sum.y());
+		p.sum[2] = static_cast<float>(pixel.sum.z());
+		p.samples = static_cast<uint32_t>(pixel.samples);
+		return p;
+	}
+
+	// The stored pixels of row y, left to right.
+	const film_pixel* row(const int y) const { return &pixels_[index(0, y)]; }
+
+	int samples(const int x, const int y) const { return static_cast<int>(pixels_[index(x, y)].samples); }
+
+	color estimate(const int x, const int y) const
+	{
+		const film_pixel& p = pixels_[index(x, y)];
+		return p.samples > 0 ? color(p.sum[0], p.sum[1], p.sum[2]) / p.samples : color(0, 0, 0);
+	}
+
+	// The pixel's accumulated state. Mean and deviations are zero unless variance is tracked.
+	pixel_estimate at(const int x, const int y) const
+	{
+		const size_t i = index(x, y);
+		pixel_estimate pixel;
+		pixel.sum = color(pixels_[i].sum[0], pixels_[i].sum[1], pixels_[i].sum[2]);
+		pixel.samples = static_cast<int>(pixels_[i].samples);
+		if (tracks_variance())
+		{
+			pixel.mean = variance_[i].mean;
+			pixel.m2 = variance_[i].m2;
+		}
+		return pixel;
+	}
+
+	// Adds a finished tile's samples. Tiles don't overlap, so workers can merge concurrently.
+	void merge(const tile_buffer& local)
+	{
+		const image_tile& tile = local.tile();
+		for (int y = tile.y0; y < tile.y1; ++y)
+		{
+			for (int x = tile.x0; x < tile.x1; ++x)
+			{
+				const pixel_estimate& added = local.at(x, y);
+				if (added.samples == 0) continue;
+
+				pixel_estimate pixel = at(x, y);
+				pixel.merge(added);
+				store(index(x, y), pixel);
+			}
+		}
+	}
+
+	long long total_samples() const
+	{
+		long long total = 0;
+		for (const auto& p : pixels_) total += p.samples;
+		return total;
+	}
+
+	// The raw accumulation state, in native byte order, for checkpoints. A stream written by one
+	// framebuffer reads back into another of the same size and variance tracking.
+	bool write_state(std::ostream& out) const
+	{
+		out.write(reinterpret_cast<const char*>(pixels_.data()), static_cast<std::streamsize>(pixels_.size() * sizeof(film_pixel)));
+		out.write(reinterpret_cast<const char*>(variance_.data()), static_cast<std::streamsize>(variance_.size() * sizeof(film_variance)));
+		return static_cast<bool>(out);
+	}
+
+	bool read_state(std::istream& in)
+	{
+		in.read(reinterpret_cast<char*>(pixels_.data()), static_cast<std::streamsize>(pixels_.size() * sizeof(film_pixel)));
+		in.read(reinterpret_cast<char*>(variance_.data()), static_cast<std::streamsize>(variance_.size() * sizeof(film_variance)));
+		return static_cast<bool>(in);
+	}
+
+private:
+	struct film_variance
+	{
+		float mean = 0;
+		float m2 = 0;
+	};
+
+	int width_;
+	int height_;
+	std::vector<film_pixel> pixels_;
+	std::vector<film_variance> variance_; // Empty unless variance is tracked
+
+	size_t index(const int x, const int y) const { return static_cast<size_t>(y) * width_ + x; }
+
+	void store(const size_t i, const pixel_estimate& pixel)
+	{
+		pixels_[i] = stored(pixel);
+		if (tracks_variance())
+		{
+			variance_[i].mean = static_cast<float>(pixel.mean);
+			variance_[i].m2 = static_cast<float>(pixel.m2);
+		}
+	}
+};
@@ -0,0 +1,326 @@
+#pragma once
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define RENDER_IMAGE_OUTPUT_SSE 1
+#endif
+
+#include "render/framebuffer.h"
+#include "utils/parallel.h"
+
+
+enum class image_format
+{
+	ppm, // Binary P6, 8 bits per channel, gamma 2
+	pfm, // Portable float map: linear 32-bit float RGB, for HDR tools
+	png // 8 bits per channel, gamma 2; stored without compression
+};
+
+inline const char* image_extension(const image_format format)
+{
+	switch (format)
+	{
+	case image_format::pfm:
+		return ".pfm";
+	case image_format::png:
+		return ".png";
+	default:
+		return ".ppm";
+	}
+}
+
+
+// Linear value to a display byte: gamma 2, then [0, 1) to [0, 255].
+inline uint8_t gamma_byte(const double linear)
+{
+	double value = linear_to_gamma(linear);
+	value = value > 0.999 ? 0.999 : value;
+	return static_cast<uint8_t>(256 * value);
+}
+
+
+// Film rows are converted in single precision, with SSE2 four pixels at a time: each group of
+// four 16-byte pixels is transposed into one register per channel and one of sample counts.
+
+#if defined(RENDER_IMAGE_OUTPUT_SSE)
+// Estimates of pixels[0..3], one channel per register; zero for pixels without samples.
+inline void load_estimates(const framebuffer::film_pixel* pixels, __m128& r, __m128& g, __m128& b)
+{
+	r = _mm_loadu_ps(pixels[0].sum);
+	g = _mm_loadu_ps(pixels[1].sum);
+	b = _mm_loadu_ps(pixels[2].sum);
+	__m128 counts = _mm_loadu_ps(pixels[3].sum);
+	_MM_TRANSPOSE4_PS(r, g, b, counts);
+
+	// Dividing, rather than multiplying by the reciprocal, keeps each value correctly rounded.
+	const __m128 samples = _mm_cvtepi32_ps(_mm_castps_si128(counts));
+	const __m128 sampled = _mm_cmpgt_ps(samples, _mm_setzero_ps());
+	r = _mm_and_ps(sampled, _mm_div_ps(r, samples));
+	g = _mm_and_ps(sampled, _mm_div_ps(g, samples));
+	b = _mm_and_ps(sampled, _mm_div_ps(b, samples));
+}
+#endif
+
+inline float estimate_channel(const framebuffer::film_pixel& pixel, const int channel)
+{
+	return pixel.samples > 0 ? pixel.sum[channel] / static_cast<float>(pixel.samples) : 0.0f;
+}
+
+// Gamma 2 bytes of `count` film pixels, as gamma_byte() makes them.
+inline void quantize_row(const framebuffer::film_pixel* pixels, const int count, uint8_t* rgb)
+{
+	int x = 0;
+#if defined(RENDER_IMAGE_OUTPUT_SSE)
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 limit = _mm_set1_ps(0.999f);
+	const __m128 range = _mm_set1_ps(256.0f);
+	for (; x + 4 <= count; x += 4)
+	{
+		__m128 channels[3];
+		load_estimates(pixels + x, channels[0], channels[1], channels[2]);
+
+		alignas(16) int32_t bytes[3][4];
+		for (int c = 0; c < 3; c++)
+		{
+			// max and min return their second operand for NaN, so NaN ends up as 0 like in gamma_byte.
+			const __m128 gamma = _mm_sqrt_ps(_mm_max_ps(channels[c], zero));
+			_mm_store_si128(reinterpret_cast<__m128i*>(bytes[c]), _mm_cvttps_epi32(_mm_mul_ps(_mm_min_ps(gamma, limit), range)));
+		}
+
+		for (int k = 0; k < 4; k++)
+			for (int c = 0; c < 3; c++)
+				rgb[3 * (x + k) + c] = static_cast<uint8_t>(bytes[c][k]);
+	}
+#endif
+	for (; x < count; x++)
+		for (int c = 0; c < 3; c++)
+			rgb[3 * x + c] = gamma_byte(estimate_channel(pixels[x], c));
+}
+
+// Linear float RGB of `count` film pixels.
+inline void resolve_row(const framebuffer::film_pixel* pixels, const int count, float* rgb)
+{
+	int x = 0;
+#if defined(RENDER_IMAGE_OUTPUT_SSE)
+	for (; x + 4 <= count; x += 4)
+	{
+		__m128 r, g, b, unused = _mm_setzero_ps();
+		load_estimates(pixels + x, r, g, b);
+		_MM_TRANSPOSE4_PS(r, g, b, unused);
+
+		// Back to one pixel per register; each store's fourth float is overwritten by the next.
+		alignas(16) float last[4];
+		_mm_storeu_ps(rgb + 3 * x, r);
+		_mm_storeu_ps(rgb + 3 * x + 3, g);
+		_mm_storeu_ps(rgb + 3 * x + 6, b);
+		_mm_store_ps(last, unused);
+		std::memcpy(rgb + 3 * x + 9, last, 3 * sizeof(float));
+	}
+#endif
+	for (; x < count; x++)
+		for (int c = 0; c < 3; c++)
+			rgb[3 * x + c] = estimate_channel(pixels[x], c);
+}
+
+
+/// <summary>
+/// Runs body(y, row) for every row of a `width` x `height` image of `channels` values of T, on
+/// the worker pool in bands of rows, and returns the rows packed top to bottom.
+/// </summary>
+template <typename T, typename Body>
+std::vector<T> convert_rows(const int width, const int height, const int channels, Body&& body)
+{
+	const size_t row_size = static_cast<size_t>(width) * channels;
+	std::vector<T> image(row_size * height);
+	parallel_for_chunks(static_cast<size_t>(height), 16, [&](size_t, const size_t begin, const size_t end)
+	{
+		for (size_t y = begin; y < end; y++) body(static_cast<int>(y), image.data() + y * row_size);
+	});
+	return image;
+}
+
+inline std::vector<uint8_t> quantize_rgb8(const framebuffer& film)
+{
+	return convert_rows<uint8_t>(film.width(), film.height(), 3, [&](const int y, uint8_t* row)
+	{
+		quantize_row(film.row(y), film.width(), row);
+	});
+}
+
+
+// The whole file is assembled in memory and handed to the stream in one write.
+inline bool write_file(const std::string& path, const std::vector<char>& bytes)
+{
+	std::ofstream out(path, std::ios::binary);
+	if (!out) return false;
+	out.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+	return static_cast<bool>(out);
+}
+
+inline void append(std::vector<char>& bytes, const void* data, const size_t size)
+{
+	if (size == 0) return; // data may be null
+	const size_t offset = bytes.size();
+	bytes.resize(offset + size);
+	std::memcpy(bytes.data() + offset, data, size);
+}
+
+inline void append(std::vector<char>& bytes, const std::string& text)
+{
+	append(bytes, text.data(), text.size());
+}
+
+
+// Binary PPM of `channels` bytes per pixel: 1 writes a gray P5, 3 an RGB P6.
+inline bool write_pnm(const std::string& path, const int width, const int height, const int channels,
+                      const std::vector<uint8_t>& pixels)
+{
+	std::vector<char> bytes;
+	bytes.reserve(pixels.size() + 32);
+	append(bytes, std::string(channels == 1 ? "P5\n" : "P6\n") + std::to_string(width) + ' ' + std::to_string(height) + "\n255\n");
+	append(bytes, pixels.data(), pixels.size());
+	return write_file(path, bytes);
+}
+
+
+inline bool write_pfm(const std::string& path, const framebuffer& film)
+{
+	// PFM stores rows bottom to top; -1 as the scale marks little-endian floats.
+	const int height = film.height();
+	const std::vector<float> pixels = convert_rows<float>(film.width(), height, 3, [&](const int y, float* row)
+	{
+		resolve_row(film.row(height - 1 - y), film.width(), row);
+	});
+
+	std::vector<char> bytes;
+	bytes.reserve(pixels.size() * sizeof(float) + 32);
+	append(bytes, "PF\n" + std::to_string(film.width()) + ' ' + std::to_string(height) + "\n-1.0\n");
+	append(bytes, pixels.data(), pixels.size() * sizeof(float));
+	return write_file(path, bytes);
+}
+
+
+/// <summary>
+/// PNG with the image data in stored (uncompressed) deflate blocks: no zlib dependency, and
+/// about the size of a binary PPM, which every viewer opens.
+/// </summary>
+inline bool write_png(const std::string& path, const int width, const int height, const std::vector<uint8_t>& rgb)
+{
+	struct crc_table
+	{
+		uint32_t entries[256];
+
+		crc_table()
+		{
+			for (uint32_t n = 0; n < 256; n++)
+			{
+				uint32_t c = n;
+				for (int k = 0; k < 8; k++) c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+				entries[n] = c;
+			}
+		}
+	};
+	static const crc_table table;
+
+	auto put_u32 = [](std::vector<char>& out, const uint32_t value)
+	{
+		const char be[4] = {
+			static_cast<char>(value >> 24), static_cast<char>(value >> 16),
+			static_cast<char>(value >> 8), static_cast<char>(value)
+		};
+		append(out, be, 4);
+	};
+
+	std::vector<char> bytes;
+	auto put_chunk = [&](const char type[4], const std::vector<char>& data)
+	{
+		put_u32(bytes, static_cast<uint32_t>(data.size()));
+		const size_t start = bytes.size();
+		append(bytes, type, 4);
+		append(bytes, data.data(), data.size());
+
+		uint32_t crc = 0xffffffffu;
+		for (size_t i = start; i < bytes.size(); i++)
+			crc = table.entries[(crc ^ static_cast<uint8_t>(bytes[i])) & 0xff] ^ (crc >> 8);
+		put_u32(bytes, crc ^ 0xffffffffu);
+	};
+
+	// Every row starts with its filter type, 0 (none).
+	const size_t row_size = static_cast<size_t>(width) * 3;
+	std::vector<uint8_t> raw((row_size + 1) * height);
+	for (int y = 0; y < height; y++)
+	{
+		raw[y * (row_size + 1)] = 0;
+		std::memcpy(&raw[y * (row_size + 1) + 1], &rgb[y * row_size], row_size);
+	}
+
+	std::vector<char> header;
+	put_u32(header, static_cast<uint32_t>(width));
+	put_u32(header, static_cast<uint32_t>(height));
+	const char format[5] = {8, 2, 0, 0, 0}; // 8-bit RGB, deflate, adaptive filtering, no interlace
+	append(header, format, 5);
+
+	// zlib stream: header, stored blocks of at most 65535 bytes, Adler-32 of the raw data.
+	std::vector<char> zlib;
+	zlib.reserve(raw.size() + raw.size() / 65535 * 5 + 16);
+	const char zlib_header[2] = {0x78, 0x01};
+	append(zlib, zlib_header, 2);
+	size_t offset = 0;
+	do
+	{
+		const size_t length = raw.size() - offset < 65535 ? raw.size() - offset : 65535;
+		const bool last = offset + length == raw.size();
+		const char block[5] = {
+			static_cast<char>(last ? 1 : 0),
+			static_cast<char>(length & 0xff), static_cast<char>(length >> 8),
+			static_cast<char>(~length & 0xff), static_cast<char>((~length >> 8) & 0xff)
+		};
+		append(zlib, block, 5);
+		append(zlib, raw.data() + offset, length);
+		offset += length;
+	}
+	while (offset < raw.size());
+
+	// Adler-32, reducing modulo 65521 only every 5552 bytes, the most that can't overflow.
+	uint32_t a = 1, b = 0;
+	for (size_t begin = 0; begin < raw.size(); begin += 5552)
+	{
+		const size_t end = begin + 5552 < raw.size() ? begin + 5552 : raw.size();
+		for (size_t i = begin; i < end; i++)
+		{
+			a += raw[i];
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+	}
+	put_u32(zlib, (b << 16) | a);
+
+	const char signature[8] = {'\x89', 'P', 'N', 'G', '\r', '\n', '\x1a', '\n'};
+	bytes.reserve(zlib.size() + 64);
+	append(bytes, signature, 8);
+	put_chunk("IHDR", header);
+	put_chunk("IDAT", zlib);
+	put_chunk("IEND", {});
+	return write_file(path, bytes);
+}
+
+
+inline bool write_image(const std::string& path, const framebuffer& film, const image_format format)
+{
+	switch (format)
+	{
+	case image_format::pfm:
+		return write_pfm(path, film);
+	case image_format::png:
+		return write_png(path, film.width(), film.height(), quantize_rgb8(film));
+	default:
+		return write_pnm(path, film.width(), film.height(), 3, quantize_rgb8(film));
+	}
+}
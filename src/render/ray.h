@@ -9,6 +9,12 @@ public:
 	ray(const point3& origin, const vec3& direction, double time)
 		: origin_(origin), direction_(direction), tm(time)
 	{
+		// Precompute what every box test along this ray needs, so BVH traversal does not
+		// divide per node.
+		inv_direction_ = vec3(1.0 / direction.x(), 1.0 / direction.y(), 1.0 / direction.z());
+		sign_[0] = inv_direction_.x() < 0;
+		sign_[1] = inv_direction_.y() < 0;
+		sign_[2] = inv_direction_.z() < 0;
 	}
 
 	ray(const point3& origin, const vec3& direction)
@@ -20,6 +26,8 @@ public:
 	const point3& origin() const { return origin_; }
 	const vec3& direction() const { return direction_; }
 	double time() const { return tm; }
+	const vec3& inv_direction() const { return inv_direction_; }
+	int sign(int axis) const { return sign_[axis]; } // 1 if the direction is negative along axis
 
 
 	point3 at(double t) const
@@ -31,4 +39,6 @@ private:
 	point3 origin_;
 	vec3 direction_;
 	double tm;
+	vec3 inv_direction_;
+	int sign_[3];
 };
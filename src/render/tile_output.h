@@ -0,0 +1,235 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "render/framebuffer.h"
+#include "render/image_output.h"
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+
+/// <summary>
+/// Writes finished tiles straight into their place in a binary PPM that is allocated at full
+/// size up front, so a frame reaches disk as it renders instead of at the end. Next to it,
+/// `<path>.tiles` lists the finished tiles, one "x0 y0 x1 y1" line each after a header line
+/// "tiles width height". Finished tiles are synced to disk in batches, at most once a second
+/// and when the stream closes, and only then listed, so every tile the sidecar lists survives
+/// even a machine crash (a reader should skip a torn last line). The image is written through
+/// a memory map when `memory_mapped` is set and the map succeeds, and with positioned writes
+/// otherwise. Workers can write different tiles concurrently.
+/// </summary>
+class tile_stream
+{
+public:
+	tile_stream(const std::string& path, const int width, const int height, const bool memory_mapped)
+		: width_(width), last_sync_(std::chrono::steady_clock::now())
+	{
+		const std::string header = "P6\n" + std::to_string(width) + ' ' + std::to_string(height) + "\n255\n";
+		header_size_ = header.size();
+		file_size_ = header_size_ + static_cast<size_t>(width) * height * 3;
+
+		// Allocated at full size: black until its tiles arrive.
+		if (!open_file(path)) return;
+		if (memory_mapped) map_file();
+		if (!write_at(0, header.data(), header.size())) return;
+
+		sidecar_.open(path + ".tiles", std::ios::trunc);
+		sidecar_ << "tiles " << width << ' ' << height << '\n' << std::flush;
+		open_ = static_cast<bool>(sidecar_);
+	}
+
+	~tile_stream()
+	{
+		if (open_)
+		{
+			std::vector<image_tile> batch;
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				batch.swap(unsynced_);
+			}
+			sync_and_list(batch);
+		}
+
+#ifdef _WIN32
+		if (mapped_ != nullptr) UnmapViewOfFile(mapped_);
+		if (mapping_ != nullptr) CloseHandle(mapping_);
+		if (file_handle_ != INVALID_HANDLE_VALUE) CloseHandle(file_handle_);
+#else
+		if (mapped_ != nullptr) munmap(mapped_, file_size_);
+		if (descriptor_ >= 0) close(descriptor_);
+#endif
+	}
+
+	tile_stream(const tile_stream&) = delete;
+	tile_stream& operator=(const tile_stream&) = delete;
+
+	bool is_open() const { return open_; }
+	bool memory_mapped() const { return mapped_ != nullptr; }
+
+	// Writes the tile's pixels; the tile is listed as finished with the next sync.
+	void write_tile(const tile_buffer& local)
+	{
+		// Converted to the film's storage first, so the bytes are the ones a PPM written from the
+		// film would have.
+		const image_tile& tile = local.tile();
+		std::vector<framebuffer::film_pixel> pixels(static_cast<size_t>(tile.x1 - tile.x0));
+		write_pixels(tile, [&](const int y, uint8_t* row)
+		{
+			for (int x = tile.x0; x < tile.x1; ++x) pixels[x - tile.x0] = framebuffer::stored(local.at(x, y));
+			quantize_row(pixels.data(), tile.x1 - tile.x0, row);
+		});
+	}
+
+	// The same, from the film: for tiles whose new samples add to earlier ones.
+	void write_tile(const image_tile& tile, const framebuffer& film)
+	{
+		write_pixels(tile, [&](const int y, uint8_t* row) { quantize_row(film.row(y) + tile.x0, tile.x1 - tile.x0, row); });
+	}
+
+private:
+	int width_;
+	size_t header_size_ = 0;
+	size_t file_size_ = 0;
+	bool open_ = false;
+	std::mutex mutex_; // Guards the sidecar, the tiles waiting for a sync and the sync state
+	std::ofstream sidecar_;
+	std::vector<image_tile> unsynced_; // Written, not yet part of a sync
+	bool syncing_ = false; // A worker is syncing; the others leave it to them
+	std::chrono::steady_clock::time_point last_sync_;
+	char* mapped_ = nullptr;
+
+#ifdef _WIN32
+	HANDLE file_handle_ = INVALID_HANDLE_VALUE;
+	HANDLE mapping_ = nullptr;
+#else
+	int descriptor_ = -1;
+#endif
+
+	// quantize(y, row) fills the tile's part of row y with RGB bytes.
+	template <typename Quantize>
+	void write_pixels(const image_tile& tile, Quantize&& quantize)
+	{
+		std::vector<uint8_t> row(static_cast<size_t>(tile.x1 - tile.x0) * 3);
+
+		bool written = true;
+		for (int y = tile.y0; y < tile.y1; ++y)
+		{
+			quantize(y, row.data());
+			written = write_at(header_size_ + (static_cast<size_t>(y) * width_ + tile.x0) * 3, row.data(), row.size())
+				&& written;
+		}
+
+		std::vector<image_tile> batch;
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (written) unsynced_.push_back(tile);
+			if (syncing_ || std::chrono::steady_clock::now() - last_sync_ < std::chrono::seconds(1)) return;
+			syncing_ = true;
+			batch.swap(unsynced_);
+		}
+		sync_and_list(batch);
+	}
+
+	// Syncs the image to disk, then lists `batch`, the tiles written before the sync began. The
+	// sync runs without the lock, so other workers keep finishing tiles meanwhile.
+	void sync_and_list(const std::vector<image_tile>& batch)
+	{
+		const bool synced = batch.empty() || sync_file();
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (synced)
+		{
+			for (const image_tile& tile : batch)
+				sidecar_ << tile.x0 << ' ' << tile.y0 << ' ' << tile.x1 << ' ' << tile.y1 << '\n';
+			sidecar_ << std::flush;
+		}
+		else unsynced_.insert(unsynced_.end(), batch.begin(), batch.end()); // Retried with the next sync
+
+		syncing_ = false;
+		last_sync_ = std::chrono::steady_clock::now();
+	}
+
+	bool write_at(const size_t offset, const void* data, const size_t size)
+	{
+		if (mapped_ != nullptr)
+		{
+			std::memcpy(mapped_ + offset, data, size);
+			return true;
+		}
+
+#ifdef _WIN32
+		OVERLAPPED position = {};
+		position.Offset = static_cast<DWORD>(offset & 0xffffffffu);
+		position.OffsetHigh = static_cast<DWORD>(static_cast<unsigned long long>(offset) >> 32);
+		DWORD written = 0;
+		return WriteFile(file_handle_, data, static_cast<DWORD>(size), &written, &position) && written == size;
+#else
+		const char* bytes = static_cast<const char*>(data);
+		for (size_t done = 0; done < size;)
+		{
+			const ssize_t count = pwrite(descriptor_, bytes + done, size - done, static_cast<off_t>(offset + done));
+			if (count <= 0) return false;
+			done += static_cast<size_t>(count);
+		}
+		return true;
+#endif
+	}
+
+	bool sync_file()
+	{
+#ifdef _WIN32
+		// FlushViewOfFile only starts writing the mapped pages; FlushFileBuffers waits for them.
+		if (mapped_ != nullptr && !FlushViewOfFile(mapped_, 0)) return false;
+		return FlushFileBuffers(file_handle_) != 0;
+#else
+		if (mapped_ != nullptr && msync(mapped_, file_size_, MS_SYNC) != 0) return false;
+		return fsync(descriptor_) == 0;
+#endif
+	}
+
+	bool open_file(const std::string& path)
+	{
+#ifdef _WIN32
+		file_handle_ = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr,
+		                           CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file_handle_ == INVALID_HANDLE_VALUE) return false;
+
+		LARGE_INTEGER size;
+		size.QuadPart = static_cast<LONGLONG>(file_size_);
+		return SetFilePointerEx(file_handle_, size, nullptr, FILE_BEGIN) && SetEndOfFile(file_handle_);
+#else
+		descriptor_ = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+		return descriptor_ >= 0 && ftruncate(descriptor_, static_cast<off_t>(file_size_)) == 0;
+#endif
+	}
+
+	// Leaves mapped_ null if the file can't be mapped; writes then go through the file.
+	void map_file()
+	{
+#ifdef _WIN32
+		const auto size = static_cast<unsigned long long>(file_size_);
+		mapping_ = CreateFileMappingA(file_handle_, nullptr, PAGE_READWRITE,
+		                              static_cast<DWORD>(size >> 32), static_cast<DWORD>(size & 0xffffffffu), nullptr);
+		if (mapping_ != nullptr) mapped_ = static_cast<char*>(MapViewOfFile(mapping_, FILE_MAP_WRITE, 0, 0, 0));
+		if (mapped_ == nullptr && mapping_ != nullptr)
+		{
+			CloseHandle(mapping_);
+			mapping_ = nullptr;
+		}
+#else
+		void* view = mmap(nullptr, file_size_, PROT_READ | PROT_WRITE, MAP_SHARED, descriptor_, 0);
+		if (view != MAP_FAILED) mapped_ = static_cast<char*>(view);
+#endif
+	}
+};
@@ -0,0 +1,169 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+
+enum class tile_order
+{
+	scanline, // Row by row
+	morton, // Z-order curve over the tile grid
+	hilbert // Hilbert curve: like Z order, but consecutive tiles always share an edge
+};
+
+
+// Pixels [x0, x1) x [y0, y1) of the image.
+struct image_tile
+{
+	int x0, y0;
+	int x1, y1;
+};
+
+
+inline uint32_t tile_curve_index(const tile_order order, uint32_t x, uint32_t y, const uint32_t grid_size)
+{
+	if (order == tile_order::morton)
+	{
+		uint32_t index = 0;
+		for (int bit = 0; bit < 16; bit++)
+			index |= ((x >> bit) & 1) << (2 * bit) | ((y >> bit) & 1) << (2 * bit + 1);
+		return index;
+	}
+
+	if (order == tile_order::hilbert)
+	{
+		// xy2d from Hilbert's construction: pick the quadrant, then rotate/flip the coordinates
+		// into that quadrant's frame and descend.
+		uint32_t index = 0;
+		for (uint32_t s = grid_size / 2; s > 0; s /= 2)
+		{
+			const uint32_t rx = (x & s) > 0;
+			const uint32_t ry = (y & s) > 0;
+			index += s * s * ((3 * rx) ^ ry);
+			if (ry == 0)
+			{
+				if (rx == 1)
+				{
+					x = grid_size - 1 - x;
+					y = grid_size - 1 - y;
+				}
+				std::swap(x, y);
+			}
+		}
+		return index;
+	}
+
+	return y * grid_size + x;
+}
+
+
+// Splits the image into tile_size x tile_size tiles (smaller at the right and bottom edges),
+// listed in the order of the given curve.
+inline std::vector<image_tile> make_tiles(const int width, const int height, const int tile_size, const tile_order order)
+{
+	const int columns = (width + tile_size - 1) / tile_size;
+	const int rows = (height + tile_size - 1) / tile_size;
+
+	uint32_t grid_size = 1;
+	while (grid_size < static_cast<uint32_t>(columns) || grid_size < static_cast<uint32_t>(rows)) grid_size *= 2;
+
+	std::vector<std::pair<uint32_t, image_tile>> keyed;
+	keyed.reserve(static_cast<size_t>(columns) * rows);
+	for (int ty = 0; ty < rows; ty++)
+	{
+		for (int tx = 0; tx < columns; tx++)
+		{
+			const image_tile tile = {
+				tx * tile_size, ty * tile_size,
+				(tx + 1) * tile_size < width ? (tx + 1) * tile_size : width,
+				(ty + 1) * tile_size < height ? (ty + 1) * tile_size : height
+			};
+			const uint32_t key = order == tile_order::scanline
+				? static_cast<uint32_t>(ty * columns + tx)
+				: tile_curve_index(order, tx, ty, grid_size);
+			keyed.emplace_back(key, tile);
+		}
+	}
+
+	std::sort(keyed.begin(), keyed.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+
+	std::vector<image_tile> tiles;
+	tiles.reserve(keyed.size());
+	for (const auto& entry : keyed) tiles.push_back(entry.second);
+	return tiles;
+}
+
+
+/// <summary>
+/// Hands out tile indices to a fixed set of worker threads. Each thread starts with its own
+/// deque holding a contiguous run of the curve-ordered tiles, so it stays in one region of the
+/// image (and of the BVH), and takes from the front. A thread that runs dry steals from the back
+/// of another's deque, the tiles that thread would reach last, so every thread stays busy until
+/// the frame is done. Tiles are coarse enough that a mutex per deque costs nothing measurable.
+/// </summary>
+class tile_scheduler
+{
+public:
+	tile_scheduler(const size_t tile_count, const int thread_count)
+		: queues_(thread_count > 0 ? static_cast<size_t>(thread_count) : 1)
+	{
+		const size_t queue_count = queues_.size();
+		for (size_t q = 0; q < queue_count; q++)
+		{
+			const size_t begin = tile_count * q / queue_count;
+			const size_t end = tile_count * (q + 1) / queue_count;
+			for (size_t t = begin; t < end; t++) queues_[q].tiles.push_back(static_cast<int>(t));
+		}
+	}
+
+	// Next tile for thread `thread_index`; false once no tile is left anywhere.
+	bool next(const int thread_index, int& tile)
+	{
+		if (pop_front(queues_[thread_index], tile)) return true;
+
+		const size_t queue_count = queues_.size();
+		for (size_t offset = 1; offset < queue_count; offset++)
+		{
+			if (pop_back(queues_[(thread_index + offset) % queue_count], tile))
+			{
+				steals_.fetch_add(1, std::memory_order_relaxed);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	long long steals() const { return steals_.load(); }
+
+private:
+	struct queue
+	{
+		std::mutex mutex;
+		std::deque<int> tiles;
+	};
+
+	std::vector<queue> queues_;
+	std::atomic<long long> steals_{0};
+
+	static bool pop_front(queue& q, int& tile)
+	{
+		std::lock_guard<std::mutex> lock(q.mutex);
+		if (q.tiles.empty()) return false;
+		tile = q.tiles.front();
+		q.tiles.pop_front();
+		return true;
+	}
+
+	static bool pop_back(queue& q, int& tile)
+	{
+		std::lock_guard<std::mutex> lock(q.mutex);
+		if (q.tiles.empty()) return false;
+		tile = q.tiles.back();
+		q.tiles.pop_back();
+		return true;
+	}
+};
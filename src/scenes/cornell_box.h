@@ -2,6 +2,7 @@
 #include "entity/hittable_list.h"
 #include "entity/material.h"
 #include "entity/quad.h"
+#include "render/camera.h"
 
 
 inline void cornell_box()
@@ -23,11 +24,13 @@ inline void cornell_box()
 	shared_ptr<hittable> box1 = box(point3(0, 0, 0), point3(165, 330, 165), white);
 	box1 = make_shared<rotate_y>(box1, 15);
 	box1 = make_shared<translate>(box1, vec3(265, 0, 295));
+	box1 = fold_transforms(box1);
 	world.add(box1);
 
 	shared_ptr<hittable> box2 = box(point3(0, 0, 0), point3(165, 165, 165), white);
 	box2 = make_shared<rotate_y>(box2, -18);
 	box2 = make_shared<translate>(box2, vec3(130, 0, 65));
+	box2 = fold_transforms(box2);
 	world.add(box2);
 
 	camera cam;
@@ -37,6 +40,8 @@ inline void cornell_box()
 	cam.samples_per_pixel = 200;
 	cam.max_depth = 50;
 	cam.background = color(0, 0, 0);
+	cam.integrator = integrator_mode::mis;
+	cam.lights = light_list(world);
 
 	cam.vfov = 40;
 	cam.lookfrom = point3(278, 278, -800);
@@ -1,18 +1,25 @@
 #pragma once
 #include "entity/constant_medium.h"
 #include "entity/hittable_list.h"
+#include "entity/instance.h"
 #include "entity/material.h"
 #include "entity/quad.h"
 #include "entity/sphere.h"
-#include "math/bvh.h"
+#include "math/linear_bvh.h"
 #include "render/camera.h"
 #include "utils/ProjectUtil.h"
 
 
 inline void final_scene(int image_width = 800, int samples_per_pixel = 1000, int max_depth = 40)
 {
+	bvh_build_options bvh_options;
+	bvh_options.method = bvh_split_method::sah;
+
+	// Owns every material of the scene; primitives point into it.
+	material_table materials;
+
 	hittable_list boxes1;
-	auto ground = make_shared<lambertian>(color(0.48, 0.83, 0.53));
+	auto ground = materials.add(lambertian(color(0.48, 0.83, 0.53)));
 
 	int boxes_per_side = 20;
 	for (int i = 0; i < boxes_per_side; i++)
@@ -33,47 +40,45 @@ inline void final_scene(int image_width = 800, int samples_per_pixel = 1000, int
 
 	hittable_list world;
 
-	world.add(make_shared<bvh_node>(boxes1));
+	world.add(make_shared<linear_bvh>(boxes1, bvh_options));
 
-	auto light = make_shared<diffuse_light>(color(7, 7, 7));
+	auto light = materials.add(diffuse_light(color(7, 7, 7)));
 	world.add(make_shared<quad>(point3(123, 554, 147), vec3(300, 0, 0), vec3(0, 0, 265), light));
 
 	auto center1 = point3(400, 400, 200);
 	auto center2 = center1 + vec3(30, 0, 0);
-	auto sphere_material = make_shared<lambertian>(color(0.7, 0.3, 0.1));
+	auto sphere_material = materials.add(lambertian(color(0.7, 0.3, 0.1)));
 	world.add(make_shared<sphere>(center1, center2, 50, sphere_material));
 
-	world.add(make_shared<sphere>(point3(260, 150, 45), 50, make_shared<dielectric>(1.5)));
+	world.add(make_shared<sphere>(point3(260, 150, 45), 50, materials.add(dielectric(1.5))));
 	world.add(make_shared<sphere>(
-		point3(0, 150, 145), 50, make_shared<metal>(color(0.8, 0.8, 0.9), 1.0)
+		point3(0, 150, 145), 50, materials.add(metal(color(0.8, 0.8, 0.9), 1.0))
 	));
 
-	auto boundary = make_shared<sphere>(point3(360, 150, 145), 70, make_shared<dielectric>(1.5));
+	auto boundary = make_shared<sphere>(point3(360, 150, 145), 70, materials.add(dielectric(1.5)));
 	world.add(boundary);
 	world.add(make_shared<constant_medium>(boundary, 0.2, color(0.2, 0.4, 0.9)));
-	boundary = make_shared<sphere>(point3(0, 0, 0), 5000, make_shared<dielectric>(1.5));
+	boundary = make_shared<sphere>(point3(0, 0, 0), 5000, materials.add(dielectric(1.5)));
 	world.add(make_shared<constant_medium>(boundary, .0001, color(1, 1, 1)));
 
 	const std::string filename = get_project_root_dir() + "\\earthmap.jpg";
-	auto emat = make_shared<lambertian>(make_shared<image_texture>(filename.c_str()));
+	auto emat = materials.add(lambertian(make_shared<image_texture>(filename.c_str())));
 	world.add(make_shared<sphere>(point3(400, 200, 400), 100, emat));
 	auto pertext = make_shared<noise_texture>(0.2);
-	world.add(make_shared<sphere>(point3(220, 280, 300), 80, make_shared<lambertian>(pertext)));
+	world.add(make_shared<sphere>(point3(220, 280, 300), 80, materials.add(lambertian(pertext))));
 
 	hittable_list boxes2;
-	auto white = make_shared<lambertian>(color(.73, .73, .73));
+	auto white = materials.add(lambertian(color(.73, .73, .73)));
 	int ns = 1000;
 	for (int j = 0; j < ns; j++)
 	{
 		boxes2.add(make_shared<sphere>(point3::random(0, 165), 10, white));
 	}
 
-	world.add(make_shared<translate>(
-			make_shared<rotate_y>(
-				make_shared<bvh_node>(boxes2), 15),
-			vec3(-100, 270, 395)
-		)
-	);
+	world.add(make_shared<instance>(
+		make_shared<linear_bvh>(boxes2, bvh_options),
+		mat4::translation(vec3(-100, 270, 395)) * mat4::rotation_y(15)
+	));
 
 	camera cam;
 
@@ -82,6 +87,9 @@ inline void final_scene(int image_width = 800, int samples_per_pixel = 1000, int
 	cam.samples_per_pixel = samples_per_pixel;
 	cam.max_depth = max_depth;
 	cam.background = color(0, 0, 0);
+	cam.integrator = integrator_mode::mis;
+	cam.lights = light_list(world);
+	cam.adaptive_sampling = true; // samples_per_pixel is the cap; flat regions stop much earlier
 
 	cam.vfov = 40;
 	cam.lookfrom = point3(478, 278, -600);
@@ -0,0 +1,67 @@
+#pragma once
+#include "entity/hittable_list.h"
+#include "entity/instance.h"
+#include "entity/material.h"
+#include "entity/sphere.h"
+#include "math/linear_bvh.h"
+#include "render/camera.h"
+
+
+// Thousands of copies of final_scene's 1000-sphere cluster. The cluster's BVH is built once and
+// shared by every instance; the top-level BVH only holds the instances.
+inline void instanced_forest(int copies_per_side = 64, int image_width = 600, int samples_per_pixel = 100,
+                             int max_depth = 20)
+{
+	bvh_build_options bvh_options;
+	bvh_options.method = bvh_split_method::sah;
+
+	hittable_list cluster;
+	auto white = make_shared<lambertian>(color(.73, .73, .73));
+	for (int j = 0; j < 1000; j++)
+		cluster.add(make_shared<sphere>(point3::random(0, 165), 10, white));
+
+	auto cluster_bvh = make_shared<linear_bvh>(cluster, bvh_options);
+
+	hittable_list instances;
+	const double spacing = 250;
+	for (int i = 0; i < copies_per_side; i++)
+	{
+		for (int k = 0; k < copies_per_side; k++)
+		{
+			const auto scale = random_double(0.5, 1.2);
+			const auto position = vec3(i * spacing + random_double(-40, 40), 0, k * spacing + random_double(-40, 40));
+
+			// Rotate and scale about the cluster's center, then drop it onto its spot.
+			const mat4 placement = mat4::translation(position)
+				* mat4::rotation_y(random_double(0, 360))
+				* mat4::scaling(vec3(scale, scale, scale))
+				* mat4::translation(vec3(-82.5, 0, -82.5));
+
+			instances.add(make_shared<instance>(cluster_bvh, placement));
+		}
+	}
+
+	hittable_list world;
+	world.add(make_shared<linear_bvh>(instances, bvh_options));
+
+	auto ground = make_shared<lambertian>(color(0.48, 0.83, 0.53));
+	world.add(make_shared<sphere>(point3(0, -1000000, 0), 1000000 - 10, ground));
+
+	camera cam;
+
+	cam.aspect_ratio = 16.0 / 9.0;
+	cam.image_width = image_width;
+	cam.samples_per_pixel = samples_per_pixel;
+	cam.max_depth = max_depth;
+	cam.background = color(0.70, 0.80, 1.00);
+
+	const double extent = copies_per_side * spacing;
+	cam.vfov = 40;
+	cam.lookfrom = point3(-0.1 * extent, 0.12 * extent, -0.1 * extent);
+	cam.lookat = point3(0.5 * extent, 0, 0.5 * extent);
+	cam.vup = vec3(0, 1, 0);
+
+	cam.defocus_angle = 0;
+
+	cam.render(world, "instanced_forest");
+}
@@ -0,0 +1,386 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <pthread.h>
+#endif
+
+
+// Worker threads shared by rendering, scene preparation (BVH builds) and image output. The count
+// defaults to the hardware concurrency and can be pinned with set_worker_thread_count().
+
+inline int& configured_worker_threads()
+{
+	static int count = 0; // 0: use the hardware concurrency
+	return count;
+}
+
+inline bool& configured_thread_affinity()
+{
+	static bool pin = false;
+	return pin;
+}
+
+// Takes effect from the next parallel call made while the pool is idle (see worker_pool()).
+inline void set_worker_thread_count(const int count)
+{
+	configured_worker_threads() = count;
+}
+
+// Pins worker i to logical CPU i (modulo the CPU count). Same caveat as set_worker_thread_count.
+inline void set_worker_thread_affinity(const bool pin)
+{
+	configured_thread_affinity() = pin;
+}
+
+inline int hardware_thread_count()
+{
+	// hardware_concurrency() can be a system call; ask once.
+	static const int hardware_threads = []
+	{
+		const unsigned n = std::thread::hardware_concurrency();
+		return n == 0 ? 1 : static_cast<int>(n);
+	}();
+	return hardware_threads;
+}
+
+inline int worker_thread_count()
+{
+	if (configured_worker_threads() > 0) return configured_worker_threads();
+	return hardware_thread_count();
+}
+
+
+/// <summary>
+/// A fixed set of threads that stay alive between parallel calls, so a preview render or an
+/// animation frame doesn't pay for thread creation each time. Work is queued as tasks and
+/// collected with a task_group. Waiting is on condition variables: nobody polls.
+/// </summary>
+class thread_pool
+{
+public:
+	thread_pool(const int thread_count, const bool pin_threads)
+		: pinned_(pin_threads)
+	{
+		threads_.reserve(thread_count);
+		for (int t = 0; t < thread_count; t++)
+		{
+			threads_.emplace_back([this] { worker_loop(); });
+			if (pin_threads) pin_to_cpu(threads_.back(), t % hardware_thread_count());
+		}
+	}
+
+	~thread_pool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			stopping_ = true;
+		}
+		work_available_.notify_all();
+		for (auto& th : threads_) th.join();
+	}
+
+	thread_pool(const thread_pool&) = delete;
+	thread_pool& operator=(const thread_pool&) = delete;
+
+	int size() const { return static_cast<int>(threads_.size()); }
+	bool pinned() const { return pinned_; }
+
+	// Tasks must not throw; task_group::run() wraps them so that they don't.
+	void submit(std::function<void()> task)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			tasks_.push_back(std::move(task));
+			unfinished_++;
+		}
+		work_available_.notify_one();
+	}
+
+	// Runs one queued task on the calling thread, if there is one.
+	bool run_pending_task()
+	{
+		std::function<void()> task;
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (tasks_.empty()) return false;
+			task = std::move(tasks_.front());
+			tasks_.pop_front();
+		}
+		task();
+		finish_task();
+		return true;
+	}
+
+	// No task queued or running, so none can still be using the pool.
+	bool idle()
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		return unfinished_ == 0;
+	}
+
+private:
+	std::vector<std::thread> threads_;
+	std::deque<std::function<void()>> tasks_;
+	std::mutex mutex_;
+	std::condition_variable work_available_;
+	int unfinished_ = 0; // Tasks submitted and not yet done
+	bool stopping_ = false;
+	bool pinned_;
+
+	void finish_task()
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		unfinished_--;
+	}
+
+	void worker_loop()
+	{
+		while (true)
+		{
+			std::function<void()> task;
+			{
+				std::unique_lock<std::mutex> lock(mutex_);
+				work_available_.wait(lock, [this] { return stopping_ || !tasks_.empty(); });
+				if (tasks_.empty()) return;
+				task = std::move(tasks_.front());
+				tasks_.pop_front();
+			}
+			task();
+			finish_task();
+		}
+	}
+
+	static void pin_to_cpu(std::thread& th, const int cpu)
+	{
+#ifdef _WIN32
+		SetThreadAffinityMask(th.native_handle(), static_cast<DWORD_PTR>(1) << (cpu % 64));
+#else
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		pthread_setaffinity_np(th.native_handle(), sizeof(set), &set);
+#endif
+	}
+};
+
+
+// The process-wide pool, recreated to match the configured thread count and affinity. It is only
+// replaced while idle: with work in flight, or when called from one of its own tasks, the current
+// pool is returned and the change waits for a later call. A task_group must not be reused after a
+// change, since it keeps the pool it was made with.
+inline thread_pool& worker_pool()
+{
+	static std::unique_ptr<thread_pool> pool;
+	static std::mutex pool_mutex;
+
+	std::lock_guard<std::mutex> lock(pool_mutex);
+	const int count = worker_thread_count();
+	if (!pool || ((pool->size() != count || pool->pinned() != configured_thread_affinity()) && pool->idle()))
+	{
+		pool.reset();
+		pool = std::make_unique<thread_pool>(count, configured_thread_affinity());
+	}
+	return *pool;
+}
+
+
+/// <summary>
+/// Tasks submitted to the pool together, and waited for together. wait() runs queued tasks on
+/// the calling thread while any of the group's are outstanding, so a task may itself start and
+/// wait for a nested group without tying up a worker. If a task throws, the others still run
+/// and wait() rethrows the first exception once they are done.
+/// </summary>
+class task_group
+{
+public:
+	explicit task_group(thread_pool& pool = worker_pool()) : pool_(pool)
+	{
+	}
+
+	// Waits, but drops an exception nobody collected with wait(): destructors can't throw.
+	~task_group() { finish(); }
+
+	task_group(const task_group&) = delete;
+	task_group& operator=(const task_group&) = delete;
+
+	template <typename Task>
+	void run(Task&& task)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			pending_++;
+		}
+		pool_.submit([this, task = std::forward<Task>(task)]() mutable
+		{
+			std::exception_ptr error;
+			try
+			{
+				task();
+			}
+			catch (...)
+			{
+				error = std::current_exception();
+			}
+
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (error && !error_) error_ = error;
+			if (--pending_ == 0) done_.notify_all();
+		});
+	}
+
+	void wait()
+	{
+		finish();
+
+		std::exception_ptr error;
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			std::swap(error, error_);
+		}
+		if (error) std::rethrow_exception(error);
+	}
+
+	// Waits at most `timeout` without helping; true once every task has finished.
+	template <typename Rep, typename Period>
+	bool wait_for(const std::chrono::duration<Rep, Period>& timeout)
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		return done_.wait_for(lock, timeout, [this] { return pending_ == 0; });
+	}
+
+private:
+	thread_pool& pool_;
+	std::mutex mutex_;
+	std::condition_variable done_;
+	int pending_ = 0;
+	std::exception_ptr error_; // First exception a task threw, until wait() rethrows it
+
+	void finish()
+	{
+		while (!finished() && pool_.run_pending_task())
+		{
+		}
+
+		std::unique_lock<std::mutex> lock(mutex_);
+		done_.wait(lock, [this] { return pending_ == 0; });
+	}
+
+	bool finished()
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		return pending_ == 0;
+	}
+};
+
+
+/// <summary>
+/// Splits [0, count) into chunks of `grain` items and calls body(chunk_index, begin, end) for
+/// each of them on the pool's threads, the calling thread included. Returns when all chunks are
+/// done. Chunk indices are dense, so callers can keep one partial result per chunk.
+/// </summary>
+template <typename Body>
+void parallel_for_chunks(const size_t count, size_t grain, Body&& body)
+{
+	if (grain == 0) grain = 1;
+	const size_t chunk_count = (count + grain - 1) / grain;
+
+	auto run_chunk = [&](const size_t chunk)
+	{
+		const size_t begin = chunk * grain;
+		const size_t end = begin + grain < count ? begin + grain : count;
+		body(chunk, begin, end);
+	};
+
+	const size_t workers = chunk_count > 1 ? static_cast<size_t>(worker_thread_count()) : 1;
+	const size_t thread_count = chunk_count < workers ? chunk_count : workers;
+	if (thread_count <= 1)
+	{
+		for (size_t chunk = 0; chunk < chunk_count; chunk++) run_chunk(chunk);
+		return;
+	}
+
+	std::atomic<size_t> next_chunk{0};
+	auto worker = [&]()
+	{
+		while (true)
+		{
+			const size_t chunk = next_chunk.fetch_add(1);
+			if (chunk >= chunk_count) break;
+			run_chunk(chunk);
+		}
+	};
+
+	task_group group;
+	for (size_t t = 1; t < thread_count; ++t) group.run(worker);
+	worker();
+	group.wait();
+}
+
+
+/// <summary>
+/// Parallel partition of items[start, end). Each chunk is partitioned in place on a worker, then
+/// the chunks' halves are gathered so that every item satisfying `pred` precedes every item that
+/// does not. Returns the index of the first item of the second group.
+/// </summary>
+template <typename T, typename Pred>
+size_t parallel_partition(std::vector<T>& items, const size_t start, const size_t end, Pred pred, const size_t grain)
+{
+	const size_t count = end - start;
+	const size_t chunk_count = (count + grain - 1) / grain;
+	std::vector<size_t> first_counts(chunk_count);
+
+	parallel_for_chunks(count, grain, [&](const size_t chunk, const size_t begin, const size_t chunk_end)
+	{
+		const auto first = items.begin() + static_cast<std::ptrdiff_t>(start + begin);
+		const auto last = items.begin() + static_cast<std::ptrdiff_t>(start + chunk_end);
+		first_counts[chunk] = static_cast<size_t>(std::partition(first, last, pred) - first);
+	});
+
+	// Destination of each chunk's two halves in the gathered order.
+	std::vector<size_t> first_offsets(chunk_count);
+	std::vector<size_t> second_offsets(chunk_count);
+	size_t total_first = 0;
+	for (size_t chunk = 0; chunk < chunk_count; chunk++)
+	{
+		first_offsets[chunk] = total_first;
+		total_first += first_counts[chunk];
+	}
+	size_t second_offset = total_first;
+	for (size_t chunk = 0; chunk < chunk_count; chunk++)
+	{
+		const size_t chunk_size = (chunk + 1) * grain < count ? grain : count - chunk * grain;
+		second_offsets[chunk] = second_offset;
+		second_offset += chunk_size - first_counts[chunk];
+	}
+
+	std::vector<T> gathered(count);
+	parallel_for_chunks(count, grain, [&](const size_t chunk, const size_t begin, const size_t chunk_end)
+	{
+		const size_t split = begin + first_counts[chunk];
+		for (size_t i = begin; i < split; i++)
+			gathered[first_offsets[chunk] + (i - begin)] = std::move(items[start + i]);
+		for (size_t i = split; i < chunk_end; i++)
+			gathered[second_offsets[chunk] + (i - split)] = std::move(items[start + i]);
+	});
+
+	parallel_for_chunks(count, grain, [&](size_t, const size_t begin, const size_t chunk_end)
+	{
+		for (size_t i = begin; i < chunk_end; i++) items[start + i] = std::move(gathered[i]);
+	});
+
+	return start + total_first;
+}
@@ -0,0 +1,74 @@
+#pragma once
+#include <cstdint>
+
+
+/// <summary>
+/// PCG32 (O'Neill 2014): 64-bit LCG state with a permuted 32-bit output. 16 bytes of state, so
+/// reseeding it for every camera sample is cheap.
+/// </summary>
+class pcg32
+{
+public:
+	pcg32()
+	{
+		seed(0x853c49e6748fea9bull, 0xda3e39cb94b95bdbull);
+	}
+
+	void seed(const uint64_t initial_state, const uint64_t sequence)
+	{
+		state_ = 0;
+		increment_ = (sequence << 1) | 1;
+		next_u32();
+		state_ += initial_state;
+		next_u32();
+	}
+
+	uint32_t next_u32()
+	{
+		const uint64_t old = state_;
+		state_ = old * 6364136223846793005ull + increment_;
+		const auto xorshifted = static_cast<uint32_t>(((old >> 18) ^ old) >> 27);
+		const auto rotation = static_cast<uint32_t>(old >> 59);
+		return (xorshifted >> rotation) | (xorshifted << ((32 - rotation) & 31));
+	}
+
+	// In [0, 1), with 32 random bits.
+	double next_double() { return next_u32() * 0x1p-32; }
+
+private:
+	uint64_t state_ = 0;
+	uint64_t increment_ = 1;
+};
+
+
+inline uint64_t mix_bits(uint64_t x)
+{
+	// splitmix64 finalizer.
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ull;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebull;
+	x ^= x >> 31;
+	return x;
+}
+
+
+// The calling thread's generator. It starts from a fixed seed, so scene setup is reproducible;
+// the camera reseeds it for every sample with seed_thread_rng().
+inline pcg32& thread_rng()
+{
+	thread_local pcg32 rng;
+	return rng;
+}
+
+/// <summary>
+/// Seeds the thread's generator from a camera sample's identity alone, so a sample draws the
+/// same numbers whichever thread renders it, and a frame is identical across thread counts and
+/// runs (and can be split across machines).
+/// </summary>
+inline void seed_thread_rng(const int x, const int y, const uint32_t sample_index, const uint32_t frame_seed)
+{
+	const uint64_t pixel = (static_cast<uint64_t>(static_cast<uint32_t>(y)) << 32) | static_cast<uint32_t>(x);
+	const uint64_t state = mix_bits(mix_bits(pixel) ^ sample_index);
+	thread_rng().seed(state, frame_seed);
+}
@@ -2,9 +2,11 @@
 
 #include <limits>
 #include <memory>
-#include <random>
 #include <thread>
 
+#include "utils/rng.h"
+#include "utils/sampler.h"
+
 
 // C++ Std Usings
 
@@ -30,10 +32,11 @@ inline double degrees_to_radians(const double degrees)
 
 inline double random_double()
 {
-	// 线程安全：每个线程拥有自己的随机数引擎与分布
-	thread_local std::uniform_real_distribution<double> distribution(0.0, 1.0);
-	thread_local std::mt19937 generator(std::random_device{}());
-	return distribution(generator);
+	// Inside a render pass the thread's sampler, if any, supplies the next sample dimension.
+	if (sampler* s = active_sampler()) return s->next_1d();
+
+	// 线程安全：每个线程拥有自己的随机数引擎
+	return thread_rng().next_double();
 }
 
 inline double random_double(const double min, const double max)
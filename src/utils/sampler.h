@@ -0,0 +1,294 @@
+#pragma once
+#include <cstdint>
+
+
+// Sample generators. While a sampler is active on a thread (see sampler_scope), random_double()
+// returns successive dimensions of the current sample from it instead of white noise, so the
+// camera, materials, lights and media all draw low-discrepancy values without knowing it.
+
+enum class sampler_type
+{
+	independent, // White noise from the thread's random generator
+	sobol, // Owen-scrambled Sobol, scrambled differently per pixel
+	blue_noise // One Owen-scrambled Sobol sequence across the image in shuffled Z order
+};
+
+
+class sampler
+{
+public:
+	virtual ~sampler() = default;
+
+	// Starts sample `sample_index` of pixel (x, y); dimensions count from 0 again.
+	virtual void start_sample(int x, int y, uint32_t sample_index) = 0;
+
+	// Next dimension of the current sample, in [0, 1).
+	virtual double next_1d() = 0;
+};
+
+
+inline sampler*& active_sampler()
+{
+	thread_local sampler* current = nullptr;
+	return current;
+}
+
+
+// Installs a sampler on the calling thread for the scope's lifetime.
+class sampler_scope
+{
+public:
+	explicit sampler_scope(sampler* s) : previous_(active_sampler())
+	{
+		active_sampler() = s;
+	}
+
+	~sampler_scope() { active_sampler() = previous_; }
+
+	sampler_scope(const sampler_scope&) = delete;
+	sampler_scope& operator=(const sampler_scope&) = delete;
+
+private:
+	sampler* previous_;
+};
+
+
+inline uint32_t reverse_bits(uint32_t x)
+{
+	x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+	x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+	x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+	x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+	return (x >> 16) | (x << 16);
+}
+
+inline uint32_t hash_u32(uint32_t x)
+{
+	// lowbias32 integer hash (Chris Wellons).
+	x ^= x >> 16;
+	x *= 0x7feb352du;
+	x ^= x >> 15;
+	x *= 0x846ca68bu;
+	x ^= x >> 16;
+	return x;
+}
+
+inline uint32_t hash_combine(const uint32_t seed, const uint32_t value)
+{
+	return seed ^ (hash_u32(value) + 0x9e3779b9u + (seed << 6) + (seed >> 2));
+}
+
+
+/// <summary>
+/// Owen scrambling by hashing (Burley 2020, "Practical Hash-based Owen Scrambling"): the
+/// Laine-Karras permutation on the bit-reversed value flips each bit depending only on the bits
+/// above it, which is a nested uniform scramble.
+/// </summary>
+inline uint32_t owen_scramble(uint32_t x, const uint32_t seed)
+{
+	x = reverse_bits(x);
+	x += seed;
+	x ^= x * 0x6c50b47cu;
+	x ^= x * 0xb82f1e52u;
+	x ^= x * 0xc7afe638u;
+	x ^= x * 0x8d22f6e6u;
+	return reverse_bits(x);
+}
+
+
+/// <summary>
+/// Point `index` of the first four dimensions of the Sobol sequence (Joe-Kuo direction numbers).
+/// Further dimensions are padded from independently shuffled and scrambled copies of these four.
+/// </summary>
+inline void sobol_sample_4d(const uint32_t index, uint32_t x[4])
+{
+	struct direction_table
+	{
+		// XOR of the generator matrix columns selected by each value of each index byte, for all
+		// four dimensions at once: a point is then four lookups instead of a loop over 32 bits.
+		uint32_t bytes[4][256][4];
+
+		direction_table()
+		{
+			// Primitive polynomial degree s, its coefficients a and initial m values per dimension.
+			constexpr int degree[4] = {0, 1, 2, 3};
+			constexpr uint32_t coefficients[4] = {0, 0, 1, 1};
+			constexpr uint32_t initial[4][3] = {{0, 0, 0}, {1, 0, 0}, {1, 3, 0}, {1, 3, 1}};
+
+			uint32_t v[32][4]; // Column k of every dimension's generator matrix
+			for (int k = 0; k < 32; k++) v[k][0] = 1u << (31 - k);
+
+			for (int d = 1; d < 4; d++)
+			{
+				const int s = degree[d];
+				for (int k = 0; k < 32; k++)
+				{
+					if (k < s)
+					{
+						v[k][d] = initial[d][k] << (31 - k);
+						continue;
+					}
+
+					uint32_t value = v[k - s][d] ^ (v[k - s][d] >> s);
+					for (int i = 1; i < s; i++)
+						if ((coefficients[d] >> (s - 1 - i)) & 1) value ^= v[k - i][d];
+					v[k][d] = value;
+				}
+			}
+
+			for (int byte = 0; byte < 4; byte++)
+			{
+				for (int value = 0; value < 256; value++)
+				{
+					for (int d = 0; d < 4; d++)
+					{
+						uint32_t x = 0;
+						for (int bit = 0; bit < 8; bit++)
+							if (value & (1 << bit)) x ^= v[8 * byte + bit][d];
+						bytes[byte][value][d] = x;
+					}
+				}
+			}
+		}
+	};
+	static const direction_table table;
+
+	for (int d = 0; d < 4; d++)
+	{
+		x[d] = table.bytes[0][index & 0xff][d] ^ table.bytes[1][(index >> 8) & 0xff][d]
+			^ table.bytes[2][(index >> 16) & 0xff][d] ^ table.bytes[3][index >> 24][d];
+	}
+}
+
+
+/// <summary>
+/// Shuffled, Owen-scrambled Sobol (Burley 2020). Dimensions are drawn in blocks of four; each
+/// block shuffles the sample order and scrambles every dimension with its own seed, so blocks
+/// are decorrelated from each other and from neighbouring pixels.
+/// </summary>
+class sobol_sampler : public sampler
+{
+public:
+	explicit sobol_sampler(const uint32_t seed = 0) : seed_(seed)
+	{
+	}
+
+	void start_sample(const int x, const int y, const uint32_t sample_index) override
+	{
+		sequence_seed_ = hash_combine(hash_combine(seed_, static_cast<uint32_t>(x)), static_cast<uint32_t>(y));
+		index_ = sample_index;
+		dimension_ = 0;
+	}
+
+	double next_1d() override
+	{
+		const int component = dimension_ & 3;
+		if (component == 0) fill_block(static_cast<uint32_t>(dimension_ >> 2));
+		dimension_++;
+		return block_[component] * 0x1p-32;
+	}
+
+protected:
+	uint32_t seed_;
+	uint32_t sequence_seed_ = 0;
+	uint32_t index_ = 0;
+
+private:
+	int dimension_ = 0;
+	uint32_t block_[4] = {};
+
+	void fill_block(const uint32_t block)
+	{
+		const uint32_t block_seed = hash_combine(sequence_seed_, block);
+		sobol_sample_4d(owen_scramble(index_, block_seed), block_);
+		for (int d = 0; d < 4; d++)
+			block_[d] = owen_scramble(block_[d], hash_combine(block_seed, static_cast<uint32_t>(d + 1)));
+	}
+};
+
+
+/// <summary>
+/// Distributes error as blue noise across the screen (Ahmed and Wonka 2020, "Screen-Space
+/// Blue-Noise Diffusion of Monte Carlo Sampling Error via Hierarchical Ordering of Pixels"). All
+/// pixels share one scrambled Sobol sequence; each pixel takes a consecutive run of
+/// `samples_per_pixel` points, in Z order with the quadrants shuffled at every level, so nearby
+/// pixels get complementary points.
+///
+/// The pixel's place in Z order and its sample number share the 32-bit Sobol index. An image
+/// with more pixels than that leaves room for is split into square tiles that do fit, each
+/// with its own scrambled sequence. Samples past a pixel's run wrap around into a sequence
+/// scrambled afresh for every further run, instead of running into the next pixel's points.
+/// </summary>
+class blue_noise_sampler : public sobol_sampler
+{
+public:
+	blue_noise_sampler(const int samples_per_pixel, const int width, const int height, const uint32_t seed = 0)
+		: sobol_sampler(seed), log2_samples_(run_log2(samples_per_pixel))
+	{
+		const int side = width > height ? width : height;
+		while ((1 << tile_levels_) < side && tile_levels_ < 16) tile_levels_++;
+		if (2 * tile_levels_ + log2_samples_ > 32) tile_levels_ = (32 - log2_samples_) / 2;
+	}
+
+	void start_sample(const int x, const int y, const uint32_t sample_index) override
+	{
+		const uint32_t tile_mask = (1u << tile_levels_) - 1;
+		const uint32_t run = sample_index >> log2_samples_;
+
+		// The same sequence for every pixel of a tile, and of a run of samples.
+		sobol_sampler::start_sample(x >> tile_levels_, y >> tile_levels_, 0);
+		if (run > 0) sequence_seed_ = hash_combine(sequence_seed_, run);
+
+		const uint32_t pixel = shuffled_z_order(static_cast<uint32_t>(x) & tile_mask, static_cast<uint32_t>(y) & tile_mask);
+		index_ = (pixel << log2_samples_) | (sample_index & ((1u << log2_samples_) - 1));
+	}
+
+	// Each pixel's run of points is 2^run_log2(samples_per_pixel) long: renders whose counts give
+	// the same run share one layout of the sequence.
+	static int run_log2(const int samples_per_pixel)
+	{
+		int log2 = 0;
+		while ((1 << log2) < samples_per_pixel && log2 < 16) log2++;
+		return log2;
+	}
+
+private:
+	int log2_samples_;
+	int tile_levels_ = 0; // Z order levels in a tile: tiles are 2^tile_levels_ pixels square
+
+	static uint32_t spread_bits(uint32_t x)
+	{
+		x &= 0x0000ffffu;
+		x = (x | (x << 8)) & 0x00ff00ffu;
+		x = (x | (x << 4)) & 0x0f0f0f0fu;
+		x = (x | (x << 2)) & 0x33333333u;
+		x = (x | (x << 1)) & 0x55555555u;
+		return x;
+	}
+
+	uint32_t shuffled_z_order(const uint32_t x, const uint32_t y) const
+	{
+		// The 24 orderings of a quadrant's four children.
+		static constexpr uint8_t permutations[24][4] = {
+			{0, 1, 2, 3}, {0, 1, 3, 2}, {0, 2, 1, 3}, {0, 2, 3, 1}, {0, 3, 1, 2}, {0, 3, 2, 1},
+			{1, 0, 2, 3}, {1, 0, 3, 2}, {1, 2, 0, 3}, {1, 2, 3, 0}, {1, 3, 0, 2}, {1, 3, 2, 0},
+			{2, 0, 1, 3}, {2, 0, 3, 1}, {2, 1, 0, 3}, {2, 1, 3, 0}, {2, 3, 0, 1}, {2, 3, 1, 0},
+			{3, 0, 1, 2}, {3, 0, 2, 1}, {3, 1, 0, 2}, {3, 1, 2, 0}, {3, 2, 0, 1}, {3, 2, 1, 0}
+		};
+
+		const uint32_t morton = spread_bits(x) | (spread_bits(y) << 1);
+
+		// From the top level down, each base 4 digit is permuted by a choice that depends only
+		// on the digits above it, so every quadrant is reordered consistently. Only the tile's
+		// levels are shuffled: permuting the zero digits above them would fill the high bits.
+		uint32_t shuffled = 0;
+		for (int level = tile_levels_ - 1; level >= 0; level--)
+		{
+			const uint32_t prefix = level == 15 ? 0 : morton >> (2 * (level + 1));
+			const uint32_t digit = (morton >> (2 * level)) & 3;
+			const uint32_t choice = hash_combine(hash_combine(seed_, static_cast<uint32_t>(level)), prefix) % 24;
+			shuffled |= static_cast<uint32_t>(permutations[choice][digit]) << (2 * level);
+		}
+		return shuffled;
+	}
+};